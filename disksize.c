@@ -6,19 +6,31 @@
 #define _LARGEFILE64_SOURCE
 #define _GNU_SOURCE
 
+#include <aio.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <signal.h>
 #include <linux/fs.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #define MINBLOCKSIZE 512
 #define MAXBLOCKSIZE 4096 // largest block size currently used
+#define ALIGNED __attribute__((aligned(MAXBLOCKSIZE))) // for O_DIRECT buffers
 
 char * filename; // global for error reporting
 size_t blocksize; // actual block size to save argument passing
@@ -67,185 +79,5383 @@ int confirm() {
     return *lineptr == 'Y';
 }
 
-// seek then read with some error reporting
-void checkedread(off_t address, void * buf, size_t size) {
-    int fd = open(filename, O_LARGEFILE|O_RDWR);
-    if (fd < 0) {
-        switch (errno) {
-            case ENODEV:
-            case ENXIO:
-            case ENOMEDIUM:
-                printf("No device connected at %s\n", filename);
-                exit(-1);
-            case ENOENT:
-                printf("%s does not exist\n", filename);
-                exit(-1);
-            case EPERM:
-            case EACCES:
-                printf("You aren't allowed to open %s\n", filename);
-                exit(-1);
+double simclock; // time the simulated device has spent on I/O
+
+// Current time in seconds, for I/O deadlines and latencies
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9 + simclock;
+}
+
+// Parse a duration such as 30, 30s, 5m or 2h into seconds, -1 if bad
+double parseduration(char * text) {
+    char * end;
+    double t = strtod(text, &end);
+    switch (*end) {
+        case 'h': t *= 60; // fall through
+        case 'm': t *= 60; // fall through
+        case 's': ++end; break;
+    }
+    return ((end == text) || (*end != 0) || (t <= 0)) ? -1 : t;
+}
+
+// Explain why open() failed
+void openerror(char * name) {
+    switch (errno) {
+        case ENODEV:
+        case ENXIO:
+        case ENOMEDIUM:
+            printf("No device connected at %s\n", name);
+            break;
+        case ENOENT:
+            printf("%s does not exist\n", name);
+            break;
+        case EPERM:
+        case EACCES:
+            printf("You aren't allowed to open %s\n", name);
+            break;
+        default:
+            printf("Error opening %s: %s\n", name, strerror(errno));
+            break;
+    }
+}
+
+/* All device I/O goes through POSIX asynchronous I/O so that we can give
+ * up on a request which takes too long. Counterfeit and failing USB sticks
+ * can hang for tens of seconds or vanish mid-write, and a plain read() or
+ * write() would block until they do. When a request misses its deadline
+ * we try to cancel everything outstanding on that device and mark it as
+ * failed, so the caller can report it and carry on with anything else.
+ * A request which the kernel won't let go of still owns its aiocb and
+ * buffer, so callers must not reuse them for a failed device.
+ */
+#define IOREAD 0
+#define IOWRITE 1
+#define IOSYNC 2
+#define LATENCYHISTORY 8 // completed I/O latencies kept for timeout reports
+#define MAXQUEUEDEPTH 32 // most requests we will have in flight on a device
+#define BACKENDDEVICE 0 // a block device
+#define BACKENDFILE 1 // a regular file, such as an image
+#define BACKENDSIM 2 // the fake device simulator
+#define ENGINEAIO 0 // POSIX aio, with O_DIRECT for aligned requests
+#define ENGINEBUFFERED 1 // POSIX aio, all through the page cache
+#define ENGINEURING 2 // io_uring, with O_DIRECT for aligned requests
+#define NENGINES 3
+#define URINGCOMPLETIONS 256 // more than we ever have in flight
+
+const char * enginenames[] = { "aio", "buffered", "io_uring" };
+
+// What the kernel tells us about a device's geometry and connection
+struct topology {
+    unsigned int logical; // logical block (sector) size
+    unsigned int physical; // physical block size
+    unsigned int iomin; // minimum I/O size without read-modify-write
+    unsigned int ioopt; // optimal I/O size, 0 if not reported
+    unsigned int alignoffset; // offset of first aligned block
+    unsigned int dmaalign; // memory alignment needed for direct I/O
+    unsigned int maxsectorskb; // largest request the kernel will issue
+    unsigned int nrrequests; // depth of the block layer queue
+    unsigned int readaheadkb;
+    int rotational;
+    unsigned long long discardgranularity; // 0 if discard not supported
+    unsigned long long discardmax;
+    int discardzeroes;
+    char zoned[16]; // none, host-aware or host-managed
+    char transport[8]; // usb, nvme, sata, mmc, scsi, virtio, loop or unknown
+    char sysdir[PATH_MAX]; // sysfs directory of the whole disk
+};
+
+/* An io_uring, driven with system calls so that we don't need liburing.
+ * We submit each request as soon as we have queued it, so the submission
+ * ring never holds more than one, and reap the completion ring when we
+ * wait; each completion carries the address of its ioreq.
+ */
+struct uring {
+    int fd;
+    unsigned * sqtail;
+    unsigned * sqmask;
+    unsigned * sqarray;
+    struct io_uring_sqe * sqes;
+    unsigned * cqhead;
+    unsigned * cqtail;
+    unsigned * cqmask;
+    struct io_uring_cqe * cqes;
+};
+
+struct iodev {
+    char * name;
+    int flags; // O_RDWR or O_RDONLY
+    int backend;
+    int fd; // -1 for the simulator
+    struct simulator * sim;
+    int engine;
+    struct uring * ring; // for ENGINEURING
+    int failed; // set when an I/O misses its deadline
+    unsigned long completed; // number of I/Os which have completed
+    unsigned long long bytes; // transferred by them
+    double latency[LATENCYHISTORY]; // most recent completed I/O latencies
+    struct topology topo;
+    /* Tuned from the topology: aligned requests go through O_DIRECT, one
+     * file descriptor per queue slot because POSIX aio serialises requests
+     * on the same descriptor. Anything else uses the buffered fd.
+     */
+    size_t align; // offset, size and buffer alignment for direct I/O
+    size_t extent; // preferred size of a large transfer
+    int depth; // preferred number of requests in flight
+    int ndirect;
+    int nextdirect;
+    int direct[MAXQUEUEDEPTH];
+    long readahead; // original readahead in sectors, if rasaved
+    int rasaved;
+    struct iodev * ranext; // next device whose readahead we have changed
+};
+
+struct ioreq {
+    struct aiocb cb;
+    struct iodev * dev;
+    int op; // IOREAD, IOWRITE or IOSYNC
+    double submitted;
+    double completed; // zero while still outstanding
+    ssize_t result; // bytes transferred, or -errno
+};
+
+double iotimeout = 20.0; // seconds before we decide an I/O has hung
+struct iodev disk; // the device named on the command line
+
+/* --record keeps a trace of every I/O to the device in a binary file, so
+ * that --replay can issue the same sequence again, on this device or
+ * another, to reproduce a failure or to compare devices or engines on
+ * exactly the same workload. The file is a header and then a record for
+ * each I/O as it completes, written as they are in memory, so in the
+ * byte order of the machine which recorded it.
+ */
+#define TRACEMAGIC "DSTRACE"
+#define TRACEDIRECT 1 // went through an O_DIRECT descriptor
+
+struct traceheader {
+    char magic[8];
+    uint32_t version;
+    uint32_t blocksize; // logical block size of the recorded device
+    uint64_t devsize;
+    int64_t started; // time(), when the trace began
+};
+
+struct tracerecord {
+    uint64_t address;
+    uint64_t submitted; // nanoseconds after the trace began
+    uint32_t latency; // microseconds
+    int32_t result; // bytes transferred, or -errno
+    uint32_t size;
+    uint8_t op; // IOREAD, IOWRITE or IOSYNC
+    uint8_t flags;
+    uint8_t engine;
+    uint8_t reserved;
+};
+
+FILE * tracefile;
+double tracestart;
+
+// Add a request which has its result to the trace, if we're keeping one
+void traceio(struct ioreq * r) {
+    if ((tracefile == NULL) || (r->dev != &disk)) {
+        return;
+    }
+    struct tracerecord t;
+    memset(&t, 0, sizeof(t));
+    t.address = r->cb.aio_offset;
+    t.submitted = (r->submitted - tracestart) * 1e9;
+    t.latency = (r->completed - r->submitted) * 1e6;
+    t.result = r->result;
+    t.size = r->cb.aio_nbytes;
+    t.op = r->op;
+    t.flags = (r->cb.aio_fildes != r->dev->fd) && (r->dev->fd >= 0)
+              ? TRACEDIRECT : 0;
+    t.engine = r->dev->engine;
+    if (fwrite(&t, sizeof(t), 1, tracefile) != 1) {
+        printf("Error writing the trace: %s\n", strerror(errno));
+        exit(-1);
+    }
+}
+
+/* The in-memory fake device simulator, for trying the tests on a device
+ * whose faults we choose, on any machine and without risking real media.
+ * It is named on the command line as sim: followed by comma separated
+ * settings, for example sim:size=64G,real=8G,fake=wrap,slow=1G-2G@20:
+ *   size=    the size it reports
+ *   real=    how much it really stores (default all of it)
+ *   fake=    what happens beyond real: wrap (addresses wrap round modulo
+ *            real), drop (writes are silently lost, reads give zeros) or
+ *            none
+ *   dropbit= an address bit which it ignores
+ *   block=   its logical block size
+ *   latency= milliseconds for each I/O
+ *   slow=    a range START-END@MS which takes MS milliseconds per I/O
+ *   eio=     a range START-END where I/O fails with EIO
+ * Sizes may end in K, M, G or T. It stores only the blocks which have been
+ * written, in a hash table. It serves one request at a time, completing
+ * each as it is submitted and moving simclock on by its latency, so runs
+ * are quick and their timings are repeatable.
+ */
+#define SIMNONE 0
+#define SIMWRAP 1
+#define SIMDROP 2
+#define MAXSIMRANGES 16
+
+struct simrange {
+    off_t start;
+    off_t end;
+    double latency; // seconds, for slow ranges
+};
+
+struct simulator {
+    unsigned long long size;
+    unsigned long long real;
+    int fake; // SIMNONE, SIMWRAP or SIMDROP
+    int dropbit; // -1 if none
+    unsigned int block;
+    double latency;
+    struct simrange slow[MAXSIMRANGES];
+    int nslow;
+    struct simrange eio[MAXSIMRANGES];
+    int neio;
+    // written blocks: open addressing on the block number
+    uint64_t * keys; // block number + 1, 0 for an empty slot
+    unsigned char ** data;
+    size_t slots;
+    size_t used;
+};
+
+unsigned long long simsize(char * text, char ** end) {
+    double v = strtod(text, end);
+    switch (**end) {
+        case 'T': case 't': v *= 1024; // fall through
+        case 'G': case 'g': v *= 1024; // fall through
+        case 'M': case 'm': v *= 1024; // fall through
+        case 'K': case 'k': v *= 1024; ++*end;
+    }
+    return v;
+}
+
+// Parse START-END, returns 0 if it isn't one
+int simrangeparse(char * text, char ** end, struct simrange * r) {
+    r->start = simsize(text, end);
+    if (**end != '-') {
+        return 0;
+    }
+    r->end = simsize(*end + 1, end);
+    r->latency = 0;
+    return r->end > r->start;
+}
+
+struct simulator * simopen(char * spec) {
+    struct simulator * s = calloc(1, sizeof(*s));
+    if (s == NULL) {
+        printf("Out of memory\n");
+        exit(-1);
+    }
+    s->block = MINBLOCKSIZE;
+    s->dropbit = -1;
+    char * copy = strdup(spec);
+    for (char * item = strtok(copy, ","); item != NULL; item = strtok(NULL, ",")) {
+        char * value = strchr(item, '=');
+        char * end = "";
+        int ok = value != NULL;
+        if (ok) {
+            *value++ = '\0';
+        }
+        if (!ok) {
+        } else if (strcmp(item, "size") == 0) {
+            s->size = simsize(value, &end);
+        } else if (strcmp(item, "real") == 0) {
+            s->real = simsize(value, &end);
+        } else if (strcmp(item, "fake") == 0) {
+            s->fake = (strcmp(value, "wrap") == 0) ? SIMWRAP
+                      : (strcmp(value, "drop") == 0) ? SIMDROP : SIMNONE;
+            ok = (s->fake != SIMNONE) || (strcmp(value, "none") == 0);
+        } else if (strcmp(item, "dropbit") == 0) {
+            s->dropbit = strtol(value, &end, 10);
+            ok = (s->dropbit >= 0) && (s->dropbit < 63);
+        } else if (strcmp(item, "block") == 0) {
+            s->block = simsize(value, &end);
+            ok = (s->block >= MINBLOCKSIZE) && (s->block <= MAXBLOCKSIZE)
+                 && ((s->block & (s->block - 1)) == 0);
+        } else if (strcmp(item, "latency") == 0) {
+            s->latency = strtod(value, &end) / 1000;
+        } else if ((strcmp(item, "slow") == 0) && (s->nslow < MAXSIMRANGES)) {
+            struct simrange * r = s->slow + s->nslow++;
+            ok = simrangeparse(value, &end, r) && (*end == '@');
+            if (ok) {
+                r->latency = strtod(end + 1, &end) / 1000;
+            }
+        } else if ((strcmp(item, "eio") == 0) && (s->neio < MAXSIMRANGES)) {
+            ok = simrangeparse(value, &end, s->eio + s->neio++);
+        } else {
+            ok = 0;
+        }
+        if (!ok || (*end != '\0')) {
+            printf("Don't understand %s in the simulator settings %s\n",
+                   item, spec);
+            exit(-1);
+        }
+    }
+    free(copy);
+    if ((s->size == 0) || (s->size % s->block != 0)) {
+        printf("The simulator needs a size which is a multiple of its block size\n");
+        exit(-1);
+    }
+    if ((s->real == 0) || (s->real > s->size) || (s->fake == SIMNONE)) {
+        s->real = s->size;
+    }
+    s->real = s->real / s->block * s->block;
+    return s;
+}
+
+// Where a block's data is kept, NULL if it has never been written
+unsigned char ** simslot(struct simulator * s, uint64_t block, int create) {
+    if (create && (2 * (s->used + 1) > s->slots)) {
+        struct simulator old = *s;
+        s->slots = s->slots ? 2 * s->slots : 1024;
+        s->keys = calloc(s->slots, sizeof(*s->keys));
+        s->data = calloc(s->slots, sizeof(*s->data));
+        if ((s->keys == NULL) || (s->data == NULL)) {
+            printf("Out of memory\n");
+            exit(-1);
+        }
+        s->used = 0;
+        for (size_t i = 0; i < old.slots; ++i) {
+            if (old.keys[i] != 0) {
+                *simslot(s, old.keys[i] - 1, 1) = old.data[i];
+            }
+        }
+        free(old.keys);
+        free(old.data);
+    }
+    if (s->slots == 0) {
+        return NULL;
+    }
+    size_t i = (block * 0x9E3779B97F4A7C15ULL) % s->slots;
+    while ((s->keys[i] != 0) && (s->keys[i] != block + 1)) {
+        i = (i + 1) % s->slots;
+    }
+    if (s->keys[i] == 0) {
+        if (!create) {
+            return NULL;
+        }
+        s->keys[i] = block + 1;
+        s->data[i] = NULL;
+        ++s->used;
+    }
+    return s->data + i;
+}
+
+// Carry out a request, as the simulated device would
+void simio(struct ioreq * r) {
+    struct simulator * s = r->dev->sim;
+    off_t address = r->cb.aio_offset;
+    size_t size = r->cb.aio_nbytes;
+    unsigned char * buf = (unsigned char *)r->cb.aio_buf;
+    double latency = s->latency;
+    r->result = size;
+    if (r->op != IOSYNC) {
+        for (int i = 0; i < s->nslow; ++i) {
+            if ((address < s->slow[i].end) && (address + size > s->slow[i].start)
+                && (s->slow[i].latency > latency)) {
+                latency = s->slow[i].latency;
+            }
+        }
+        if ((address < 0) || (address + size > s->size)) {
+            r->result = (address >= s->size) ? 0 : s->size - address;
+            size = r->result;
+        }
+        for (int i = 0; i < s->neio; ++i) {
+            if ((address < s->eio[i].end) && (address + size > s->eio[i].start)) {
+                r->result = -EIO;
+            }
+        }
+    }
+    for (size_t done = 0; (r->result > 0) && (done < size); ) {
+        uint64_t a = address + done;
+        if (s->dropbit >= 0) {
+            a &= ~(1ULL << s->dropbit);
+        }
+        int lost = 0;
+        if (a >= s->real) {
+            if (s->fake == SIMWRAP) {
+                a %= s->real;
+            } else {
+                lost = 1;
+            }
+        }
+        size_t offset = a % s->block;
+        size_t n = s->block - offset;
+        if (n > size - done) {
+            n = size - done;
+        }
+        unsigned char ** slot = simslot(s, a / s->block,
+                                        (r->op == IOWRITE) && !lost);
+        if (r->op == IOREAD) {
+            if ((slot == NULL) || (*slot == NULL)) {
+                memset(buf + done, 0, n);
+            } else {
+                memcpy(buf + done, *slot + offset, n);
+            }
+        } else if (!lost) {
+            if (*slot == NULL) {
+                *slot = calloc(1, s->block);
+                if (*slot == NULL) {
+                    printf("Out of memory\n");
+                    exit(-1);
+                }
+            }
+            memcpy(*slot + offset, buf + done, n);
+        }
+        done += n;
+    }
+    simclock += latency;
+    r->completed = now();
+    if (r->op == IOSYNC) {
+        r->result = 0;
+    }
+    r->dev->latency[r->dev->completed++ % LATENCYHISTORY] = latency;
+    r->dev->bytes += (r->result > 0) ? r->result : 0;
+    traceio(r);
+}
+
+/* Open a device for asynchronous I/O, flags O_RDWR or O_RDONLY.
+ * Returns -1 with errno set on failure.
+ */
+int devopen(struct iodev * dev, char * name, int flags) {
+    memset(dev, 0, sizeof(*dev));
+    dev->name = name;
+    dev->flags = flags;
+    if (strncmp(name, "sim:", 4) == 0) {
+        dev->backend = BACKENDSIM;
+        dev->sim = simopen(name + 4);
+        dev->fd = -1;
+        return 0;
+    }
+    dev->fd = open(name, O_LARGEFILE|flags);
+    struct stat st;
+    if ((dev->fd >= 0) && (fstat(dev->fd, &st) == 0) && S_ISREG(st.st_mode)) {
+        dev->backend = BACKENDFILE;
+    }
+    return dev->fd < 0 ? -1 : 0;
+}
+
+// The size of a device, returns -1 with errno set on failure
+int devsize(struct iodev * dev, unsigned long long * size) {
+    struct stat st;
+    switch (dev->backend) {
+        case BACKENDSIM:
+            *size = dev->sim->size;
+            return 0;
+        case BACKENDFILE:
+            if (fstat(dev->fd, &st) != 0) {
+                return -1;
+            }
+            *size = st.st_size;
+            return 0;
+        default:
+            return ioctl(dev->fd, BLKGETSIZE64, size);
+    }
+}
+
+/* Returns -1 with errno set if the kernel doesn't give us a ring, or if
+ * it can't wait for completions with a timeout (before Linux 5.11), in
+ * which case we would have to poll and had better use aio.
+ */
+int uringsetup(struct uring * u, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = URINGCOMPLETIONS;
+    u->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0) {
+        return -1;
+    }
+    if ((p.features & IORING_FEAT_EXT_ARG) == 0) {
+        close(u->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+    size_t sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    unsigned char * sq = mmap(NULL, sqsize, PROT_READ|PROT_WRITE,
+                              MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    unsigned char * cq = mmap(NULL, cqsize, PROT_READ|PROT_WRITE,
+                              MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                   PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd,
+                   IORING_OFF_SQES);
+    if ((sq == MAP_FAILED) || (cq == MAP_FAILED) || (u->sqes == MAP_FAILED)) {
+        close(u->fd);
+        return -1;
+    }
+    u->sqtail = (unsigned *)(sq + p.sq_off.tail);
+    u->sqmask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sqarray = (unsigned *)(sq + p.sq_off.array);
+    u->cqhead = (unsigned *)(cq + p.cq_off.head);
+    u->cqtail = (unsigned *)(cq + p.cq_off.tail);
+    u->cqmask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+
+// Queue one request on the submission ring, for the caller to submit
+void uringpush(struct uring * u, int opcode, int fd, void * buf, size_t size,
+               off_t address, uint64_t data) {
+    unsigned tail = *u->sqtail;
+    unsigned i = tail & *u->sqmask;
+    struct io_uring_sqe * e = u->sqes + i;
+    memset(e, 0, sizeof(*e));
+    e->opcode = opcode;
+    e->fd = fd;
+    e->addr = (uintptr_t)buf;
+    e->len = size;
+    e->off = address;
+    e->user_data = data;
+    u->sqarray[i] = i;
+    __atomic_store_n(u->sqtail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Record a request's result, however it completed
+void iocomplete(struct ioreq * r, ssize_t result) {
+    r->result = result;
+    r->completed = now();
+    r->dev->latency[r->dev->completed++ % LATENCYHISTORY] =
+        r->completed - r->submitted;
+    r->dev->bytes += (r->result > 0) ? r->result : 0;
+    traceio(r);
+}
+
+/* Complete the requests which the kernel has finished with. Returns how
+ * many answers to cancels there were.
+ */
+int uringreap(struct uring * u) {
+    int cancels = 0;
+    unsigned head = *u->cqhead;
+    while (head != __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe * c = u->cqes + (head & *u->cqmask);
+        struct ioreq * r = (struct ioreq *)(uintptr_t)c->user_data;
+        if (r == NULL) {
+            ++cancels;
+        } else {
+            iocomplete(r, (r->op == IOSYNC) && (c->res == 0) ? 0 : c->res);
+        }
+        __atomic_store_n(u->cqhead, ++head, __ATOMIC_RELEASE);
+    }
+    return cancels;
+}
+
+// Wait up to seconds for a completion; timeouts and signals are fine here
+void uringwait(struct uring * u, double seconds) {
+    struct __kernel_timespec ts;
+    ts.tv_sec = (long long)seconds;
+    ts.tv_nsec = (long long)((seconds - ts.tv_sec) * 1e9);
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uintptr_t)&ts;
+    syscall(__NR_io_uring_enter, u->fd, 0, 1,
+            IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+/* Cancel a device's outstanding io_uring requests and wait a little for
+ * the kernel to answer, so that those it could cancel are finished with
+ * before their slots are used again. Any which it couldn't cancel, which
+ * are stuck in the driver, are left for the caller to abandon.
+ */
+#define URINGCANCELWAIT 1.0 // seconds
+void uringcancel(struct iodev * dev, struct ioreq * reqs, int n) {
+    int asked = 0;
+    for (int i = 0; i < n; ++i) {
+        if ((reqs[i].dev == dev) && (reqs[i].completed == 0)) {
+            // the cancel's own completion has no request
+            uringpush(dev->ring, IORING_OP_ASYNC_CANCEL, -1, reqs + i, 0, 0, 0);
+            ++asked;
+        }
+    }
+    if ((asked == 0) || (syscall(__NR_io_uring_enter, dev->ring->fd, asked, 0,
+                                 0, NULL, 0) != asked)) {
+        return;
+    }
+    double until = now() + URINGCANCELWAIT;
+    for (int answered = uringreap(dev->ring); answered < asked; ) {
+        double t = now();
+        if (t >= until) {
+            break;
+        }
+        uringwait(dev->ring, until - t);
+        answered += uringreap(dev->ring);
+    }
+}
+
+void ioprepare(struct ioreq * r, struct iodev * dev, int op,
+               off_t address, void * buf, size_t size) {
+    memset(r, 0, sizeof(*r));
+    r->dev = dev;
+    r->cb.aio_fildes = dev->fd;
+    r->cb.aio_offset = address;
+    r->cb.aio_buf = buf;
+    r->cb.aio_nbytes = size;
+    r->cb.aio_sigevent.sigev_notify = SIGEV_NONE;
+    r->op = op;
+}
+
+// Start a request, returns -1 if it could not be queued
+int iosubmit(struct ioreq * r) {
+    struct iodev * dev = r->dev;
+    int res;
+    int direct = (dev->ndirect > 0) && (dev->engine != ENGINEBUFFERED)
+        && (r->op != IOSYNC)
+        && (((r->cb.aio_offset | r->cb.aio_nbytes | (uintptr_t)r->cb.aio_buf)
+             & (dev->align - 1)) == 0);
+    if (direct) {
+        r->cb.aio_fildes = dev->direct[dev->nextdirect++ % dev->ndirect];
+    } else {
+        r->cb.aio_fildes = dev->fd;
+    }
+    r->submitted = now();
+    r->completed = 0;
+    if (dev->backend == BACKENDSIM) {
+        simio(r);
+        return 0;
+    }
+    if ((r->op == IOREAD) && !direct) {
+        /* We don't want to see what's in the page cache, especially if
+         * we just wrote it: drop any clean cached pages so that the
+         * read goes to the device. The advice only covers whole pages.
+         */
+        off_t page = sysconf(_SC_PAGESIZE);
+        off_t start = r->cb.aio_offset & ~(page - 1);
+        off_t end = (r->cb.aio_offset + r->cb.aio_nbytes + page - 1)
+                    & ~(page - 1);
+        posix_fadvise(dev->fd, start, end - start, POSIX_FADV_DONTNEED);
+    }
+    if (dev->engine == ENGINEURING) {
+        static const int opcodes[] = {
+            IORING_OP_READ, IORING_OP_WRITE, IORING_OP_FSYNC
+        };
+        uringpush(dev->ring, opcodes[r->op], r->cb.aio_fildes,
+                  (void *)r->cb.aio_buf, r->cb.aio_nbytes, r->cb.aio_offset,
+                  (uintptr_t)r);
+        res = (syscall(__NR_io_uring_enter, dev->ring->fd, 1, 0, 0,
+                       NULL, 0) == 1) ? 0 : -1;
+    } else {
+        switch (r->op) {
+            case IOREAD:
+                res = aio_read(&r->cb);
+                break;
+            case IOWRITE:
+                res = aio_write(&r->cb);
+                break;
             default:
-                printf("Error opening %s: %s\n", filename, strerror(errno));
-                exit(-1);
+                res = aio_fsync(O_SYNC, &r->cb);
+                break;
+        }
+    }
+    if (res != 0) {
+        r->result = -errno;
+        r->completed = r->submitted;
+        traceio(r);
+    }
+    return res;
+}
+
+// Report a device which has stopped responding
+void iotimedout(struct iodev * dev, struct ioreq * reqs, int n, double t) {
+    static const char * opnames[] = { "read", "write", "sync" };
+    printf("%s has stopped responding and has been marked as failed:\n",
+           dev->name);
+    for (int i = 0; i < n; ++i) {
+        struct ioreq * r = reqs + i;
+        if ((r->dev == dev) && (r->completed == 0)) {
+            printf("    %s of %lu bytes at address %ld outstanding for %.3f seconds\n",
+                   opnames[r->op], r->cb.aio_nbytes, r->cb.aio_offset,
+                   t - r->submitted);
+        }
+    }
+    int k = dev->completed < LATENCYHISTORY ? dev->completed : LATENCYHISTORY;
+    if (k > 0) {
+        printf("    latencies of the last %d completed I/Os:", k);
+        for (int i = k; i > 0; --i) {
+            printf(" %.3f",
+                   dev->latency[(dev->completed - i) % LATENCYHISTORY]);
+        }
+        printf(" seconds\n");
+    }
+}
+
+/* Wait for requests to finish, until no more than left are outstanding.
+ * Each one has until iotimeout seconds after it was submitted. The
+ * requests may be for different devices: one which misses a deadline is
+ * marked failed and its outstanding requests are abandoned with ETIMEDOUT,
+ * but we go on waiting for the other devices. Returns 0 when enough
+ * requests have their own result, or -1 if any device failed.
+ */
+int iowaitsome(struct ioreq * reqs, int n, int left) {
+    const struct aiocb * list[n];
+    int failed = 0;
+    for (;;) {
+        int k = 0;
+        int naio = 0;
+        struct uring * ring = NULL;
+        double deadline = 0;
+        for (int i = 0; i < n; ++i) {
+            struct iodev * dev = reqs[i].dev;
+            if ((reqs[i].completed == 0) && (dev->engine == ENGINEURING)
+                && !dev->failed) {
+                uringreap(dev->ring);
+            }
+        }
+        for (int i = 0; i < n; ++i) {
+            struct ioreq * r = reqs + i;
+            if (r->completed != 0) { continue; }
+            int err = (r->dev->engine == ENGINEURING) ? EINPROGRESS
+                                                      : aio_error(&r->cb);
+            if (err == EINPROGRESS) {
+                if ((k == 0) || (r->submitted + iotimeout < deadline)) {
+                    deadline = r->submitted + iotimeout;
+                }
+                ++k;
+                if (r->dev->engine == ENGINEURING) {
+                    ring = r->dev->ring;
+                } else {
+                    list[naio++] = &r->cb;
+                }
+                continue;
+            }
+            ssize_t nn = aio_return(&r->cb);
+            iocomplete(r, err ? -err : nn);
+        }
+        if (k <= left) {
+            return failed ? -1 : 0;
+        }
+        double t = now();
+        if (t >= deadline) {
+            for (int i = 0; i < n; ++i) {
+                struct iodev * dev = reqs[i].dev;
+                if ((reqs[i].completed != 0)
+                    || (reqs[i].submitted + iotimeout > t) || dev->failed) {
+                    continue;
+                }
+                dev->failed = 1;
+                iotimedout(dev, reqs, n, t);
+                if (dev->engine == ENGINEURING) {
+                    uringcancel(dev, reqs, n);
+                } else {
+                    aio_cancel(dev->fd, NULL);
+                    for (int d = 0; d < dev->ndirect; ++d) {
+                        aio_cancel(dev->direct[d], NULL);
+                    }
+                }
+                for (int j = 0; j < n; ++j) {
+                    if ((reqs[j].dev == dev) && (reqs[j].completed == 0)) {
+                        reqs[j].result = -ETIMEDOUT;
+                        reqs[j].completed = t;
+                        traceio(reqs + j);
+                    } else if ((reqs[j].dev == dev)
+                               && (reqs[j].result == -ECANCELED)) {
+                        reqs[j].result = -ETIMEDOUT; // we cancelled it just now
+                    }
+                }
+                failed = 1;
+            }
+            continue;
+        }
+        if (ring != NULL) {
+            // poll any aio requests too, though we don't mix engines
+            uringwait(ring, ((naio > 0) && (deadline - t > 0.001))
+                            ? 0.001 : deadline - t);
+            continue;
+        }
+        struct timespec ts;
+        ts.tv_sec = (time_t)(deadline - t);
+        ts.tv_nsec = (long)((deadline - t - ts.tv_sec) * 1e9);
+        aio_suspend(list, naio, &ts); // EAGAIN and EINTR are fine here
+    }
+}
+
+int iowait(struct ioreq * reqs, int n) {
+    return iowaitsome(reqs, n, 0);
+}
+
+// Submit a batch of requests and wait for all of them
+int iobatch(struct ioreq * reqs, int n) {
+    int failed = 0;
+    for (int i = 0; i < n; ++i) {
+        if (reqs[i].dev->failed) {
+            reqs[i].result = -ETIMEDOUT;
+            reqs[i].submitted = reqs[i].completed = now();
+            failed = 1;
+        } else {
+            iosubmit(reqs + i);
+        }
+    }
+    return iowait(reqs, n) || failed ? -1 : 0;
+}
+
+// Allocate a buffer suitably aligned for direct I/O
+unsigned char * iobuffer(size_t size) {
+    void * buf;
+    if (posix_memalign(&buf, disk.align > MAXBLOCKSIZE ? disk.align : MAXBLOCKSIZE,
+                       size) != 0) {
+        printf("Out of memory\n");
+        exit(-1);
+    }
+    return buf;
+}
+
+/* One I/O on the device, waiting for it to finish. The request and a copy
+ * of the data are on the heap, so that if the device stops responding we
+ * can abandon them to the kernel, as the inventory does, and the caller
+ * may reuse its buffer. Nothing more is sent to a device which has failed.
+ * Returns the result, and if took isn't NULL how long the I/O took.
+ */
+ssize_t singleio(int op, off_t address, void * buf, size_t size,
+                 double * took) {
+    if (took != NULL) {
+        *took = 0;
+    }
+    if (disk.failed) {
+        return -ETIMEDOUT;
+    }
+    struct ioreq * r = malloc(sizeof(*r));
+    unsigned char * copy = (size > 0) ? iobuffer(size) : NULL;
+    if (r == NULL) {
+        printf("Out of memory\n");
+        exit(-1);
+    }
+    if (op == IOWRITE) {
+        memcpy(copy, buf, size);
+    }
+    ioprepare(r, &disk, op, address, copy, size);
+    iobatch(r, 1);
+    ssize_t result = r->result;
+    if (took != NULL) {
+        *took = r->completed - r->submitted;
+    }
+    if (disk.failed) {
+        return result; // the kernel may still own r and copy
+    }
+    if ((op == IOREAD) && (result > 0)) {
+        memcpy(buf, copy, result);
+    }
+    free(copy);
+    free(r);
+    return result;
+}
+
+// read with some error reporting, returns 0 if we read it all
+int checkedread(off_t address, void * buf, size_t size) {
+    ssize_t result = singleio(IOREAD, address, buf, size, NULL);
+    if (result < 0) {
+        printf("Reading %lu bytes at offset %lu from %s failed: %s\n",
+                size, address, filename, strerror(-result));
+        return -1;
+    } else if (result != size) {
+        printf("Reading %lu bytes at offset %lu from %s read %ld bytes instead\n",
+                size, address, filename, result);
+        return -1;
+    }
+    return 0;
+}
+
+// write and sync with some error reporting, returns 0 if it all worked
+int checkedwrite(off_t address, void * buf, size_t size) {
+    ssize_t result = singleio(IOWRITE, address, buf, size, NULL);
+    if (result < 0) {
+        printf("Writing %lu bytes at offset %ld to %s failed: %s\n",
+                size, address, filename, strerror(-result));
+        return -1;
+    } else if (result != size) {
+        printf("Writing %lu bytes at offset %ld to %s wrote %ld bytes instead\n",
+                size, address, filename, result);
+        return -1;
+    }
+    result = singleio(IOSYNC, 0, NULL, 0, NULL);
+    if (result < 0) {
+        printf("Error fsync'ing %s: %s\n", filename, strerror(-result));
+        return -1;
+    }
+    return 0;
+}
+
+// Read a number from a sysfs file, or return dflt if we can't
+long long sysfsnumber(char * dir, char * file, long long dflt) {
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s", dir, file) >= sizeof(path)) {
+        return dflt;
+    }
+    FILE * f = fopen(path, "r");
+    if (f == NULL) {
+        return dflt;
+    }
+    long long n;
+    if (fscanf(f, "%lld", &n) != 1) {
+        n = dflt;
+    }
+    fclose(f);
+    return n;
+}
+
+// Read the first line of a sysfs file, or copy dflt if we can't
+void sysfsstring(char * dir, char * file, char * buf, int size, char * dflt) {
+    char path[PATH_MAX];
+    char format[24]; // room for any int
+    FILE * f = NULL;
+    snprintf(format, sizeof(format), "%%%d[^\n]", size - 1);
+    if (snprintf(path, sizeof(path), "%s/%s", dir, file) < sizeof(path)) {
+        f = fopen(path, "r");
+    }
+    if ((f == NULL) || (fscanf(f, format, buf) != 1)) {
+        snprintf(buf, size, "%s", dflt);
+    }
+    if (f != NULL) {
+        fclose(f);
+    }
+    for (int n = strlen(buf); (n > 0) && (buf[n - 1] == ' '); --n) {
+        buf[n - 1] = '\0'; // some devices pad their model names
+    }
+}
+
+/* Find out as much as we can about how a device wants to be driven, from
+ * the block device ioctls and from its queue directory in sysfs. Anything
+ * we can't find out gets a safe default.
+ */
+void probetopology(struct iodev * dev) {
+    struct topology * t = &dev->topo;
+    memset(t, 0, sizeof(*t));
+    int n;
+    unsigned int u;
+    unsigned short us;
+    t->logical = (ioctl(dev->fd, BLKSSZGET, &n) == 0) ? n : MINBLOCKSIZE;
+    if (dev->backend == BACKENDSIM) {
+        t->logical = dev->sim->block;
+    }
+    t->physical = (ioctl(dev->fd, BLKPBSZGET, &u) == 0) ? u : t->logical;
+    t->iomin = (ioctl(dev->fd, BLKIOMIN, &u) == 0) ? u : t->physical;
+    t->ioopt = (ioctl(dev->fd, BLKIOOPT, &u) == 0) ? u : 0;
+    t->alignoffset = (ioctl(dev->fd, BLKALIGNOFF, &n) == 0) ? n : 0;
+    t->rotational = (ioctl(dev->fd, BLKROTATIONAL, &us) == 0) ? us : 0;
+    t->discardzeroes = (ioctl(dev->fd, BLKDISCARDZEROES, &u) == 0) ? u : 0;
+    t->maxsectorskb = (ioctl(dev->fd, BLKSECTGET, &us) == 0) ? us / 2 : 0;
+    t->dmaalign = t->logical - 1;
+    snprintf(t->zoned, sizeof(t->zoned), "none");
+    snprintf(t->transport, sizeof(t->transport), "unknown");
+    struct stat st;
+    char path[sizeof(t->sysdir) + sizeof("/queue")];
+    if ((fstat(dev->fd, &st) != 0) || !S_ISBLK(st.st_mode)) {
+        return;
+    }
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u",
+             major(st.st_rdev), minor(st.st_rdev));
+    if (realpath(path, t->sysdir) == NULL) {
+        t->sysdir[0] = '\0';
+        return;
+    }
+    // A partition shares the queue of the disk which contains it
+    if (sysfsnumber(t->sysdir, "partition", 0) != 0) {
+        *strrchr(t->sysdir, '/') = '\0';
+    }
+    snprintf(path, sizeof(path), "%s/queue", t->sysdir);
+    t->maxsectorskb = sysfsnumber(path, "max_sectors_kb", t->maxsectorskb);
+    t->nrrequests = sysfsnumber(path, "nr_requests", 0);
+    t->rotational = sysfsnumber(path, "rotational", t->rotational);
+    t->discardgranularity = sysfsnumber(path, "discard_granularity", 0);
+    t->discardmax = sysfsnumber(path, "discard_max_bytes", 0);
+    if (t->discardmax == 0) {
+        t->discardgranularity = 0;
+    }
+    t->dmaalign = sysfsnumber(path, "dma_alignment", t->dmaalign);
+    t->readaheadkb = sysfsnumber(path, "read_ahead_kb", 0);
+    sysfsstring(path, "zoned", t->zoned, sizeof(t->zoned), "none");
+    static const char * transports[][2] = {
+        { "/usb", "usb" },
+        { "/nvme", "nvme" },
+        { "/ata", "sata" },
+        { "/mmc", "mmc" },
+        { "/virtio", "virtio" },
+        { "/block/loop", "loop" },
+        { "/host", "scsi" }
+    };
+    for (int i = 0; i < sizeof(transports) / sizeof(transports[0]); ++i) {
+        if (strstr(t->sysdir, transports[i][0]) != NULL) {
+            snprintf(t->transport, sizeof(t->transport), "%s",
+                     transports[i][1]);
+            break;
+        }
+    }
+}
+
+/* Choose how to drive a device from its topology:
+ * buffers, offsets and sizes aligned for O_DIRECT,
+ * large transfers of the optimal I/O size if the device reports one,
+ * otherwise the largest request the kernel will issue in one piece,
+ * and a queue depth which suits the transport: USB bridges and
+ * rotating disks gain little from more than a couple of requests,
+ * NVMe wants plenty.
+ */
+#define MINEXTENT (64 * 1024)
+#define MAXEXTENT (4 * 1024 * 1024)
+void tuneio(struct iodev * dev) {
+    struct topology * t = &dev->topo;
+    dev->align = t->logical;
+    if (t->dmaalign + 1 > dev->align) {
+        dev->align = t->dmaalign + 1;
+    }
+    size_t unit = t->physical > dev->align ? t->physical : dev->align;
+    size_t maxrequest = t->maxsectorskb ? t->maxsectorskb * 1024ULL : MAXEXTENT;
+    size_t extent = ((t->ioopt > 0) && (t->ioopt <= maxrequest))
+                    ? t->ioopt : maxrequest;
+    if (extent < MINEXTENT) { extent = MINEXTENT; }
+    if (extent > MAXEXTENT) { extent = MAXEXTENT; }
+    dev->extent = (extent / unit) * unit;
+    if ((strcmp(t->transport, "usb") == 0) || t->rotational) {
+        dev->depth = 2;
+    } else if (strcmp(t->transport, "nvme") == 0) {
+        dev->depth = MAXQUEUEDEPTH;
+    } else {
+        dev->depth = t->nrrequests / 4;
+    }
+    if ((t->nrrequests > 0) && (dev->depth > t->nrrequests)) {
+        dev->depth = t->nrrequests;
+    }
+    if (dev->depth < 1) { dev->depth = 1; }
+    if (dev->depth > MAXQUEUEDEPTH) { dev->depth = MAXQUEUEDEPTH; }
+}
+
+// Open the O_DIRECT file descriptors, one per queue slot
+void opendirect(struct iodev * dev) {
+    int fd = (dev->backend == BACKENDSIM) ? -1
+             : open(dev->name, O_LARGEFILE|O_DIRECT|dev->flags);
+    if (fd < 0) {
+        dev->ndirect = 0; // fall back to buffered I/O for everything
+        return;
+    }
+    dev->direct[0] = fd;
+    for (dev->ndirect = 1; dev->ndirect < dev->depth; ++dev->ndirect) {
+        if ((fd = dup(dev->direct[0])) < 0) {
+            break;
+        }
+        dev->direct[dev->ndirect] = fd;
+    }
+}
+
+void printtopology(struct iodev * dev) {
+    struct topology * t = &dev->topo;
+    printf("%s has %u byte logical blocks and %u byte physical blocks\n",
+           dev->name, t->logical, t->physical);
+    printf("%s reports minimum I/O size %u bytes, optimal I/O size %u bytes, alignment offset %u\n",
+           dev->name, t->iomin, t->ioopt, t->alignoffset);
+    printf("%s is a %s device on a %s connection, zoned model %s\n",
+           dev->name, t->rotational ? "rotating" : "solid state",
+           t->transport, t->zoned);
+    printf("%s accepts requests of up to %u Kibytes, queue depth %u\n",
+           dev->name, t->maxsectorskb, t->nrrequests);
+    if (t->discardgranularity) {
+        printf("%s supports discard in units of %llu bytes%s\n",
+               dev->name, t->discardgranularity,
+               t->discardzeroes ? ", discarded blocks read as zero" : "");
+    } else {
+        printf("%s does not support discard\n", dev->name);
+    }
+    printf("I/O to %s will use %lu byte alignment%s, %lu byte extents and %d requests in flight\n",
+           dev->name, dev->align, dev->ndirect ? " with O_DIRECT" : "",
+           dev->extent, dev->depth);
+}
+
+/* Buffered reads go through the device's readahead, so each single block
+ * read while probing pulls in a hundred or more Kibytes: on slow USB media
+ * that multiplies the probe time. We turn readahead off while we're reading
+ * scattered blocks and up when reading sequentially, and put it back when
+ * we exit, however that happens.
+ */
+#define READAHEADRANDOM 0
+#define READAHEADSEQUENTIAL 1
+
+struct iodev * rachanged; // devices whose readahead we have changed
+
+void restorereadahead() {
+    for (struct iodev * dev = rachanged; dev != NULL; dev = dev->ranext) {
+        ioctl(dev->fd, BLKRASET, dev->readahead);
+    }
+    rachanged = NULL;
+}
+
+void readaheadsignal(int sig) {
+    restorereadahead();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+void setreadahead(struct iodev * dev, int mode) {
+    if (!dev->rasaved) {
+        if (ioctl(dev->fd, BLKRAGET, &dev->readahead) != 0) {
+            return; // not a block device, nothing to do
+        }
+        if (rachanged == NULL) {
+            static int installed = 0;
+            if (!installed) {
+                static const int signals[] = {
+                    SIGHUP, SIGINT, SIGQUIT, SIGTERM, SIGPIPE
+                };
+                struct sigaction sa;
+                memset(&sa, 0, sizeof(sa));
+                sa.sa_handler = readaheadsignal;
+                sigemptyset(&sa.sa_mask);
+                for (int i = 0; i < sizeof(signals) / sizeof(signals[0]); ++i) {
+                    sigaction(signals[i], &sa, NULL);
+                }
+                atexit(restorereadahead);
+                installed = 1;
+            }
+        }
+        dev->rasaved = 1;
+        dev->ranext = rachanged;
+        rachanged = dev;
+    }
+    unsigned long ra = 0;
+    if (mode == READAHEADSEQUENTIAL) {
+        ra = 2 * dev->extent / 512;
+        if (ra < dev->readahead) {
+            ra = dev->readahead;
+        }
+    }
+    if (ioctl(dev->fd, BLKRASET, ra) == 0) {
+        printf("Readahead on %s set to %lu Kibytes for %s reads (was %ld Kibytes)\n",
+               dev->name, ra / 2,
+               mode == READAHEADRANDOM ? "random" : "sequential",
+               dev->readahead / 2);
+    }
+    posix_fadvise(dev->fd, 0, 0, mode == READAHEADRANDOM
+                  ? POSIX_FADV_RANDOM : POSIX_FADV_SEQUENTIAL);
+}
+
+/* CRC32 as used by GPT (and zlib), computed eight bytes at a time with the
+ * slicing-by-8 tables: a GPT entry array can be megabytes on big arrays.
+ * The content digest uses CRC32C, which only differs in the polynomial.
+ */
+uint32_t crctable[8][256];
+uint32_t crcctable[8][256];
+
+void crcmaketable(uint32_t table[8][256], uint32_t poly) {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) {
+            c = (c & 1) ? (c >> 1) ^ poly : c >> 1;
+        }
+        table[0][i] = c;
+    }
+    for (int i = 0; i < 256; ++i) {
+        for (int t = 1; t < 8; ++t) {
+            table[t][i] = (table[t - 1][i] >> 8)
+                          ^ table[0][table[t - 1][i] & 0xFF];
+        }
+    }
+}
+
+void crcinit() {
+    crcmaketable(crctable, 0xEDB88320);
+    crcmaketable(crcctable, 0x82F63B78);
+}
+
+uint32_t crcslice(uint32_t table[8][256], uint32_t crc,
+                  const unsigned char * p, size_t n) {
+    if (table[0][1] == 0) {
+        crcinit();
+    }
+    uint32_t c = ~crc;
+    for ( ; (n > 0) && ((uintptr_t)p & 7); --n) {
+        c = table[0][(c ^ *p++) & 0xFF] ^ (c >> 8);
+    }
+    for ( ; n >= 8; n -= 8, p += 8) {
+        uint32_t lo;
+        uint32_t hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= c;
+        c = table[7][lo & 0xFF] ^ table[6][(lo >> 8) & 0xFF]
+            ^ table[5][(lo >> 16) & 0xFF] ^ table[4][lo >> 24]
+            ^ table[3][hi & 0xFF] ^ table[2][(hi >> 8) & 0xFF]
+            ^ table[1][(hi >> 16) & 0xFF] ^ table[0][hi >> 24];
+    }
+    for ( ; n > 0; --n) {
+        c = table[0][(c ^ *p++) & 0xFF] ^ (c >> 8);
+    }
+    return ~c;
+}
+
+// Continue a CRC32 over more data, start with crc 0
+uint32_t crc32(uint32_t crc, const unsigned char * p, size_t n) {
+    return crcslice(crctable, crc, p, n);
+}
+
+uint32_t crc32c(uint32_t crc, const unsigned char * p, size_t n) {
+    return crcslice(crcctable, crc, p, n);
+}
+
+#define GPTSIGNATURE 0x5452415020494645ULL // "EFI PART"
+#define MAXGPTTABLE (64 * 1024 * 1024) // biggest entry array we will read
+
+// A GPT header with its addresses converted to bytes
+struct gpt {
+    size_t lbsize; // logical block size the GPT was written for
+    off_t address; // where we found the header
+    off_t myaddress;
+    off_t alternate;
+    off_t firstusable;
+    off_t lastusable;
+    off_t table;
+    uint32_t pcount;
+    uint32_t psize;
+    uint32_t headercrc; // as recorded
+    uint32_t tablecrc;
+    unsigned char guid[16];
+    int headercrcok;
+    int tablecrcok;
+    unsigned char * entries; // the entry array, NULL if we didn't read it
+};
+
+// Decode a header, returns -1 if it doesn't have a GPT signature
+int gptparse(unsigned char * buf, size_t lbsize, off_t address,
+             struct gpt * g) {
+    memset(g, 0, sizeof(*g));
+    if (*(unsigned long long *)buf != GPTSIGNATURE) {
+        return -1;
+    }
+    g->lbsize = lbsize;
+    g->address = address;
+    g->myaddress = *(off_t *)(buf + 24) * lbsize;
+    g->alternate = *(off_t *)(buf + 32) * lbsize;
+    g->firstusable = *(off_t *)(buf + 40) * lbsize;
+    g->lastusable = *(off_t *)(buf + 48) * lbsize;
+    g->table = *(off_t *)(buf + 72) * lbsize;
+    g->pcount = *(uint32_t *)(buf + 80);
+    g->psize = *(uint32_t *)(buf + 84);
+    g->headercrc = *(uint32_t *)(buf + 16);
+    g->tablecrc = *(uint32_t *)(buf + 88);
+    memcpy(g->guid, buf + 56, sizeof(g->guid));
+    uint32_t headersize = *(uint32_t *)(buf + 12);
+    if ((headersize >= 92) && (headersize <= lbsize)) {
+        unsigned char header[MAXBLOCKSIZE];
+        memcpy(header, buf, headersize);
+        memset(header + 16, 0, 4); // CRC is computed with its own field zero
+        g->headercrcok = crc32(0, header, headersize) == g->headercrc;
+    }
+    return 0;
+}
+
+// Size to read for the entry array, or 0 if the header's description is unusable
+size_t gpttablesize(struct gpt * g) {
+    size_t size = (size_t)g->pcount * g->psize;
+    if ((g->psize < 128) || (size == 0) || (size > MAXGPTTABLE)) {
+        return 0;
+    }
+    return (size + g->lbsize - 1) / g->lbsize * g->lbsize;
+}
+
+void gptchecktable(struct gpt * g) {
+    g->tablecrcok = crc32(0, g->entries, (size_t)g->pcount * g->psize)
+                    == g->tablecrc;
+}
+
+/* Fetch both headers and both entry arrays. We already have the main
+ * header, and the backup is normally in the last block with its array just
+ * before it, so we read the main array, the header where the main header
+ * says the backup is, the real last block if that's somewhere else, and
+ * the array below the backup header, all in one batch. Only a backup whose
+ * array isn't where we guessed needs a second round trip.
+ * A read which fails leaves that part missing rather than stopping us:
+ * on a fake device the end of the disk may not be readable at all.
+ */
+void gptfetch(struct gpt * primary, struct gpt * backup,
+              unsigned long long totalsize) {
+    size_t lb = primary->lbsize;
+    off_t last = (totalsize / lb - 1) * lb;
+    size_t tsize = gpttablesize(primary);
+    struct ioreq * reqs = malloc(4 * sizeof(*reqs)); // abandoned if it hangs
+    unsigned char * bufs[4] = { NULL, NULL, NULL, NULL };
+    off_t where[4] = { primary->table, primary->alternate, last,
+                       primary->alternate - (off_t)tsize };
+    size_t sizes[4] = { tsize, lb, lb, tsize };
+    int slot[4];
+    int n = 0;
+    for (int k = 0; k < 4; ++k) {
+        slot[k] = -1;
+        if ((sizes[k] == 0) || (where[k] < 0)
+            || (where[k] + sizes[k] > totalsize)
+            || ((k == 2) && (last == primary->alternate))) {
+            continue;
+        }
+        bufs[k] = iobuffer(sizes[k]);
+        ioprepare(reqs + n, &disk, IOREAD, where[k], bufs[k], sizes[k]);
+        slot[k] = n++;
+    }
+    iobatch(reqs, n); // a hung device is disk.failed, and its reads missing
+    for (int k = 0; k < 4; ++k) {
+        if ((slot[k] >= 0) && (reqs[slot[k]].result != sizes[k])) {
+            struct ioreq * r = reqs + slot[k];
+            printf("Reading %lu bytes at offset %ld from %s failed: %s\n",
+                   sizes[k], where[k], disk.name,
+                   r->result < 0 ? strerror(-r->result) : "short read");
+            if (r->result != -ETIMEDOUT) {
+                free(bufs[k]); // else the kernel may still write to it
+            }
+            bufs[k] = NULL;
+        }
+    }
+    if (!disk.failed) {
+        free(reqs);
+    }
+    if (bufs[0] != NULL) {
+        primary->entries = bufs[0];
+        gptchecktable(primary);
+    }
+    // Use the backup where the main header says, else in the last block
+    memset(backup, 0, sizeof(*backup));
+    int found = (bufs[1] != NULL)
+                && (gptparse(bufs[1], lb, where[1], backup) == 0);
+    if (!found && (bufs[2] != NULL)) {
+        found = gptparse(bufs[2], lb, last, backup) == 0;
+    }
+    if (found && ((tsize = gpttablesize(backup)) > 0)
+        && (backup->table + tsize <= totalsize)) {
+        if ((bufs[3] != NULL) && (backup->table == where[3])
+            && (tsize == sizes[3])) {
+            backup->entries = bufs[3];
+            bufs[3] = NULL;
+        } else {
+            backup->entries = iobuffer(tsize);
+            if (checkedread(backup->table, backup->entries, tsize) != 0) {
+                free(backup->entries);
+                backup->entries = NULL;
+            }
+        }
+        if (backup->entries != NULL) {
+            gptchecktable(backup);
+        }
+    }
+    free(bufs[1]);
+    free(bufs[2]);
+    free(bufs[3]);
+}
+
+/* Compare the two copies. A backup which isn't in the last block, or which
+ * is missing or damaged when the main copy is fine, is worth knowing about:
+ * a GPT written for the size a fake device claims to have puts its backup
+ * beyond the real capacity, where it won't survive.
+ */
+void gptdiff(struct gpt * primary, struct gpt * backup,
+             unsigned long long totalsize) {
+    size_t lb = primary->lbsize;
+    off_t last = (totalsize / lb - 1) * lb;
+    int problems = 0;
+    if (primary->alternate > last) {
+        printf("GPT backup header address %ld is beyond the end of %s: the device may be smaller than it was when it was partitioned, or than it claims\n",
+               primary->alternate, disk.name);
+        ++problems;
+    } else if (primary->alternate != last) {
+        printf("GPT backup header address %ld is not the last block %ld of %s\n",
+               primary->alternate, last, disk.name);
+        ++problems;
+    }
+    if (backup->lbsize == 0) {
+        printf("GPT backup header is missing or unreadable%s\n",
+               primary->headercrcok && primary->tablecrcok
+               ? " although the main copy is intact: suspect a fake device" : "");
+        return;
+    }
+    if (backup->address != primary->alternate) {
+        printf("GPT backup header found in the last block instead of at %ld\n",
+               primary->alternate);
+        ++problems;
+    }
+    if (backup->myaddress != backup->address) {
+        printf("GPT backup header is at %ld but says it is at %ld\n",
+               backup->address, backup->myaddress);
+        ++problems;
+    }
+    if (backup->alternate != primary->myaddress) {
+        printf("GPT backup header says the main header is at %ld, not %ld\n",
+               backup->alternate, primary->myaddress);
+        ++problems;
+    }
+    if (!primary->headercrcok || !backup->headercrcok) {
+        printf("GPT header CRC mismatch: main %s, backup %s\n",
+               primary->headercrcok ? "correct" : "WRONG",
+               backup->headercrcok ? "correct" : "WRONG");
+        ++problems;
+    }
+    if ((primary->entries != NULL) && (backup->entries != NULL)
+        && (!primary->tablecrcok || !backup->tablecrcok)) {
+        printf("GPT partition table CRC mismatch: main %s, backup %s\n",
+               primary->tablecrcok ? "correct" : "WRONG",
+               backup->tablecrcok ? "correct" : "WRONG");
+        ++problems;
+    }
+    if ((primary->firstusable != backup->firstusable)
+        || (primary->lastusable != backup->lastusable)
+        || (primary->pcount != backup->pcount)
+        || (primary->psize != backup->psize)
+        || (memcmp(primary->guid, backup->guid, sizeof(primary->guid)) != 0)
+        || (primary->tablecrc != backup->tablecrc)) {
+        printf("GPT backup header describes a different layout from the main header: the backup is stale\n");
+        ++problems;
+    }
+    if ((primary->entries != NULL) && (backup->entries != NULL)
+        && (primary->pcount == backup->pcount)
+        && (primary->psize == backup->psize)) {
+        size_t size = (size_t)primary->pcount * primary->psize;
+        if (memcmp(primary->entries, backup->entries, size) != 0) {
+            for (uint32_t p = 0; p < primary->pcount; ++p) {
+                size_t at = (size_t)p * primary->psize;
+                if (memcmp(primary->entries + at, backup->entries + at,
+                           primary->psize) != 0) {
+                    printf("GPT partition entry %u differs between main and backup tables\n",
+                           p + 1);
+                }
+            }
+            ++problems;
+        }
+    }
+    if (problems == 0) {
+        printf("GPT main and backup copies agree\n");
+    }
+}
+
+void partitions(struct gpt * g) {
+    printf("    %u partitions of size %u at %ld to %ld:\n",
+           g->pcount, g->psize, g->table,
+           g->table + g->pcount * (long)g->psize);
+    if (g->entries == NULL) {
+        printf("    (not a usable partition table)\n");
+        return;
+    }
+    printf("    (empty partitions omitted)\n");
+    for (uint32_t p = 0; p < g->pcount; ++p) {
+        unsigned char * entry = g->entries + (size_t)p * g->psize;
+        off_t start = *(off_t *)(entry + 32) * g->lbsize;
+        off_t end = *(off_t *)(entry + 40) * g->lbsize;
+        if (start != end) {
+            printf("        from %ld to %ld\n", start, end);
+        }
+    }
+    if (g->tablecrcok) {
+        printf("    partition table CRC 0x%08X is correct\n", g->tablecrc);
+    } else {
+        printf("    partition table CRC 0x%08X is WRONG, should be 0x%08X\n",
+               g->tablecrc,
+               crc32(0, g->entries, (size_t)g->pcount * g->psize));
+    }
+}
+
+/* Parts of the device which we know hold something: the partition table
+ * structures and the partitions themselves. If we know the layout, probes
+ * can be moved into the gaps between them, where there is nothing to save
+ * and restore. Kept sorted and merged; there are only ever a few.
+ */
+struct extent {
+    off_t start;
+    off_t end; // one past the last byte
+};
+struct extent * used;
+int nused;
+int layoutknown; // set once a partition table has told us what's used
+
+/* Add an extent to a sorted list, merging it with any it touches. Lists
+ * grow in powers of two and we find the place by bisection, so the scans,
+ * which add extents in address order, don't slow down as lists get long.
+ */
+void addextent(struct extent ** list, int * n, off_t start, off_t end) {
+    if (end <= start) {
+        return;
+    }
+    if ((*n & (*n - 1)) == 0) {
+        // *n is zero or a power of two, so the list is full
+        *list = realloc(*list, (*n ? 2 * *n : 1) * sizeof(**list));
+        if (*list == NULL) {
+            printf("Out of memory\n");
+            exit(-1);
+        }
+    }
+    struct extent * e = *list;
+    int lo = 0;
+    int hi = *n;
+    while (lo < hi) {
+        // find the first extent which doesn't end before start
+        int mid = (lo + hi) / 2;
+        if (e[mid].end < start) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    int k;
+    for (k = lo; (k < *n) && (e[k].start <= end); ++k) {
+        if (e[k].start < start) { start = e[k].start; }
+        if (e[k].end > end) { end = e[k].end; }
+    }
+    // extents lo to k - 1 are replaced by the merged one
+    memmove(e + lo + 1, e + k, (*n - k) * sizeof(*e));
+    e[lo].start = start;
+    e[lo].end = end;
+    *n += 1 - (k - lo);
+}
+
+void markused(off_t start, off_t end) {
+    addextent(&used, &nused, start, end);
+}
+
+// The partitions in the partition table, in table order
+struct extent * plist;
+int nplist;
+
+void addpartition(off_t start, off_t end) {
+    markused(start, end);
+    plist = realloc(plist, (nplist + 1) * sizeof(plist[0]));
+    if (plist == NULL) {
+        printf("Out of memory\n");
+        exit(-1);
+    }
+    plist[nplist].start = start;
+    plist[nplist++].end = end;
+}
+
+int overlaps(struct extent * list, int n, off_t address, size_t size) {
+    for (int i = 0; i < n; ++i) {
+        if ((address < list[i].end) && (address + (off_t)size > list[i].start)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int isfree(off_t address, size_t size) {
+    return layoutknown && !overlaps(used, nused, address, size);
+}
+
+/* The block nearest to address outside all the extents in a list, with
+ * lo <= block and block + blocksize <= hi, or -1 if there isn't one.
+ */
+off_t nearestgap(struct extent * list, int n, off_t address,
+                 off_t lo, off_t hi) {
+    off_t best = -1;
+    off_t gapstart = 0;
+    for (int i = 0; i <= n; ++i) {
+        off_t gapend = (i < n) ? list[i].start : hi;
+        if (gapstart < lo) { gapstart = lo; }
+        if (gapend > hi) { gapend = hi; }
+        gapstart = (gapstart + blocksize - 1) / blocksize * blocksize;
+        gapend = gapend / blocksize * blocksize;
+        if (gapend - gapstart >= (off_t)blocksize) {
+            off_t candidate = address;
+            if (candidate < gapstart) {
+                candidate = gapstart;
+            } else if (candidate > gapend - blocksize) {
+                candidate = gapend - blocksize;
+            }
+            if ((best < 0) || (llabs(candidate - address) < llabs(best - address))) {
+                best = candidate;
+            }
+        }
+        if (i < n) {
+            gapstart = list[i].end;
+        }
+    }
+    return best;
+}
+
+// Record what a good GPT tells us is in use
+void gptlayout(struct gpt * g, unsigned long long totalsize) {
+    if (!g->headercrcok || (g->entries == NULL) || !g->tablecrcok) {
+        return;
+    }
+    markused(0, g->firstusable);
+    markused(g->lastusable + g->lbsize, totalsize);
+    for (uint32_t p = 0; p < g->pcount; ++p) {
+        unsigned char * entry = g->entries + (size_t)p * g->psize;
+        off_t start = *(off_t *)(entry + 32) * g->lbsize;
+        off_t end = *(off_t *)(entry + 40) * g->lbsize;
+        if (start != end) {
+            addpartition(start, end + g->lbsize);
+        }
+    }
+    layoutknown = 1;
+}
+
+/* MBR partitioning: four primary entries in sector 0, and if one of them
+ * is an extended partition, a chain of extended boot records inside it,
+ * each describing one logical partition and where the next EBR is. The
+ * chain has to be followed one link at a time, but EBRs nearly always
+ * point forwards, so each read takes a whole extent from the EBR onwards
+ * and any later EBRs which fall inside it cost nothing.
+ */
+#define MAXMBRPARTS 128 // guards against EBR chains which loop
+#define MBRSIGNATURE 0xAA55
+
+struct mbrpart {
+    int number; // 1 to 4 primary, 5 up logical
+    unsigned char type;
+    int active;
+    off_t start; // bytes
+    off_t end; // one past the last byte
+};
+struct mbrpart mbrparts[MAXMBRPARTS];
+int nmbrparts;
+
+int isextended(unsigned char type) {
+    return (type == 0x05) || (type == 0x0F) || (type == 0x85);
+}
+
+/* Check the CHS address in an entry matches its LBA. Addresses beyond
+ * cylinder 1023 can't be expressed, so tools store 1023 or saturate.
+ */
+int chsok(unsigned char * chs, uint32_t lba, int heads, int sectors) {
+    int h = chs[0];
+    int s = chs[1] & 0x3F;
+    int c = ((chs[1] & 0xC0) << 2) | chs[2];
+    uint32_t cylinder = lba / (heads * sectors);
+    if (cylinder > 1023) {
+        return c == 1023;
+    }
+    return (c == cylinder) && (h == (lba / sectors) % heads)
+           && (s == lba % sectors + 1);
+}
+
+// Decode one entry whose LBA is relative to base (in blocks)
+void mbrentry(unsigned char * e, uint64_t base, int number, size_t lb,
+              int heads, int sectors, unsigned long long totalsize) {
+    uint32_t lba = *(uint32_t *)(e + 8);
+    uint32_t count = *(uint32_t *)(e + 12);
+    struct mbrpart * p = mbrparts + nmbrparts++;
+    p->number = number;
+    p->type = e[4];
+    p->active = e[0] == 0x80;
+    p->start = (base + lba) * lb;
+    p->end = (base + lba + count) * lb;
+    printf("MBR %s partition %d: type 0x%02X from %ld to %ld%s%s\n",
+           number <= 4 ? "primary" : "logical", number, p->type,
+           p->start, p->end, human(p->end - p->start),
+           p->active ? " (active)" : "");
+    if (p->end > totalsize) {
+        printf("    partition %d extends %ld bytes beyond the end of %s\n",
+               number, p->end - (off_t)totalsize, filename);
+    }
+    if ((e[0] != 0) && (e[0] != 0x80)) {
+        printf("    partition %d has an invalid boot flag 0x%02X\n", number, e[0]);
+    }
+    if (!chsok(e + 1, base + lba, heads, sectors)
+        || !chsok(e + 5, base + lba + count - 1, heads, sectors)) {
+        printf("    partition %d CHS addresses don't match its LBA addresses for %d heads and %d sectors\n",
+               number, heads, sectors);
+    }
+}
+
+/* Many things other than an MBR end in 0x55AA: a FAT, NTFS or exFAT
+ * filesystem written to the whole device has its boot sector there, and
+ * its boot code mustn't be taken for partition entries. Returns NULL if
+ * sector 0 looks like a real partition table, or why it doesn't.
+ */
+char * mbrproblem(unsigned char * mbr, size_t lb, unsigned long long totalsize) {
+    static char why[80];
+    int jump = ((mbr[0] == 0xEB) && (mbr[2] == 0x90)) || (mbr[0] == 0xE9);
+    if (jump && ((memcmp(mbr + 3, "NTFS    ", 8) == 0)
+                 || (memcmp(mbr + 3, "EXFAT   ", 8) == 0)
+                 || (memcmp(mbr + 54, "FAT", 3) == 0)
+                 || (memcmp(mbr + 82, "FAT32", 5) == 0))) {
+        return "has a filesystem boot sector rather than a partition table";
+    }
+    for (int k = 0; k < 4; ++k) {
+        unsigned char * e = mbr + 446 + 16 * k;
+        uint64_t lba = *(uint32_t *)(e + 8);
+        uint64_t count = *(uint32_t *)(e + 12);
+        if (((e[0] != 0) && (e[0] != 0x80))
+            || ((e[4] != 0) && ((lba == 0) || (count == 0)
+                                || ((lba + count) * lb > totalsize)))) {
+            snprintf(why, sizeof(why),
+                     "has a boot signature in sector 0, but entry %d isn't a valid partition",
+                     k + 1);
+            return why;
+        }
+    }
+    return NULL;
+}
+
+int mbrvalid(unsigned char * mbr, unsigned long long totalsize) {
+    char * why = mbrproblem(mbr, blocksize, totalsize);
+    if (why != NULL) {
+        printf("%s %s\n", filename, why);
+    }
+    return why == NULL;
+}
+
+void mbrpartitions(unsigned char * mbr, unsigned long long totalsize) {
+    size_t lb = blocksize;
+    // Find a usual geometry which fits all the primary entries
+    static const int geometries[][2] = {
+        { 255, 63 }, { 240, 63 }, { 128, 63 }, { 64, 32 }, { 16, 63 }
+    };
+    int heads = 255;
+    int sectors = 63;
+    for (int g = 0; g < sizeof(geometries) / sizeof(geometries[0]); ++g) {
+        int k;
+        for (k = 0; k < 4; ++k) {
+            unsigned char * e = mbr + 446 + 16 * k;
+            uint32_t lba = *(uint32_t *)(e + 8);
+            uint32_t count = *(uint32_t *)(e + 12);
+            if ((e[4] != 0)
+                && (!chsok(e + 1, lba, geometries[g][0], geometries[g][1])
+                    || !chsok(e + 5, lba + count - 1, geometries[g][0],
+                              geometries[g][1]))) {
+                break;
+            }
+        }
+        if (k == 4) {
+            heads = geometries[g][0];
+            sectors = geometries[g][1];
+            break;
+        }
+    }
+    nmbrparts = 0;
+    uint64_t extended = 0;
+    uint64_t extendedend = 0;
+    for (int k = 0; k < 4; ++k) {
+        unsigned char * e = mbr + 446 + 16 * k;
+        if (e[4] == 0) {
+            continue;
+        }
+        mbrentry(e, 0, k + 1, lb, heads, sectors, totalsize);
+        if (isextended(e[4]) && (extended == 0)) {
+            extended = *(uint32_t *)(e + 8);
+            extendedend = extended + *(uint32_t *)(e + 12);
+        }
+    }
+    // Follow the EBR chain
+    unsigned char * window = NULL;
+    uint64_t wstart = 0;
+    uint64_t wend = 0;
+    int reads = 0;
+    int ebrs = 0;
+    uint64_t ebr = extended;
+    int number = 5;
+    while ((ebr != 0) && (nmbrparts < MAXMBRPARTS)) {
+        if ((ebr < extended) || (ebr >= extendedend)
+            || ((ebr + 1) * lb > totalsize)) {
+            printf("EBR at block %lu is outside the extended partition or the device\n",
+                   ebr);
+            break;
+        }
+        if ((ebr < wstart) || (ebr >= wend)) {
+            uint64_t blocks = disk.extent / lb;
+            if (blocks == 0) { blocks = 1; }
+            if (ebr + blocks > extendedend) { blocks = extendedend - ebr; }
+            if ((ebr + blocks) * lb > totalsize) { blocks = totalsize / lb - ebr; }
+            free(window);
+            window = iobuffer(blocks * lb);
+            if (checkedread(ebr * lb, window, blocks * lb) != 0) {
+                break;
+            }
+            wstart = ebr;
+            wend = ebr + blocks;
+            ++reads;
+        }
+        unsigned char * b = window + (ebr - wstart) * lb;
+        ++ebrs;
+        if (*(uint16_t *)(b + 510) != MBRSIGNATURE) {
+            printf("EBR at block %lu has no boot signature\n", ebr);
+            break;
+        }
+        if (b[446 + 4] != 0) {
+            mbrentry(b + 446, ebr, number++, lb, heads, sectors, totalsize);
+        }
+        uint64_t next = isextended(b[446 + 16 + 4])
+                        ? extended + *(uint32_t *)(b + 446 + 16 + 8) : 0;
+        if ((next != 0) && (next <= ebr)) {
+            printf("EBR at block %lu points back to block %lu\n", ebr, next);
+            if (next == ebr) { break; }
+        }
+        ebr = next;
+    }
+    free(window);
+    if (ebrs > 0) {
+        printf("Read %d EBRs in %d reads\n", ebrs, reads);
+    }
+    // Check for overlaps, then record what's in use
+    for (int i = 0; i < nmbrparts; ++i) {
+        if (isextended(mbrparts[i].type)) {
+            continue;
+        }
+        for (int k = i + 1; k < nmbrparts; ++k) {
+            if (!isextended(mbrparts[k].type)
+                && (mbrparts[i].start < mbrparts[k].end)
+                && (mbrparts[k].start < mbrparts[i].end)) {
+                printf("MBR partitions %d and %d overlap\n",
+                       mbrparts[i].number, mbrparts[k].number);
+            }
+        }
+    }
+    off_t first = totalsize;
+    for (int i = 0; i < nmbrparts; ++i) {
+        if (isextended(mbrparts[i].type)) {
+            markused(mbrparts[i].start, mbrparts[i].start + lb); // the EBR
+        } else {
+            addpartition(mbrparts[i].start, mbrparts[i].end);
+        }
+        if (mbrparts[i].start < first) {
+            first = mbrparts[i].start;
+        }
+    }
+    // The gap before the first partition often holds a boot loader
+    markused(0, first);
+    layoutknown = 1;
+}
+
+/* Partitions of the device which the system is using: mounted, used for
+ * swap, or held by device mapper (LVM, dm-crypt) or md. We can still test
+ * the rest of the device as long as we never write inside them, and we
+ * claim each partition we do write in with O_EXCL so that nobody can mount
+ * it while we're testing.
+ */
+struct partition {
+    char name[NAME_MAX + 1];
+    dev_t dev;
+    off_t start;
+    off_t end;
+    char * busy; // why we mustn't write here, NULL if we may
+    int claim; // O_EXCL file descriptor once we've claimed it
+};
+struct partition * parts;
+int nparts;
+struct extent * busy; // the busy partitions
+int nbusy;
+char * devicebusy; // why nothing at all may be written, or NULL
+int deviceclaim = -1; // O_EXCL file descriptor for the whole target
+
+dev_t sysfsdev(char * dir) {
+    char buf[32];
+    unsigned int ma;
+    unsigned int mi;
+    sysfsstring(dir, "dev", buf, sizeof(buf), "");
+    return (sscanf(buf, "%u:%u", &ma, &mi) == 2) ? makedev(ma, mi) : 0;
+}
+
+// Why the block device dev with sysfs directory dir is in use, or NULL
+char * inuse(dev_t dev, char * dir) {
+    char * why = NULL;
+    char line[PATH_MAX + 256];
+    FILE * f = fopen("/proc/self/mountinfo", "r");
+    if (f == NULL) {
+        printf("cannot open /proc/self/mountinfo: %s\n", strerror(errno));
+        exit(-1);
+    }
+    while ((why == NULL) && (fgets(line, sizeof(line), f) != NULL)) {
+        unsigned int ma;
+        unsigned int mi;
+        char mountpoint[PATH_MAX];
+        char source[PATH_MAX];
+        char * fields = strstr(line, " - "); // then the type and the source
+        struct stat st;
+        if (sscanf(line, "%*d %*d %u:%u %*s %4095s", &ma, &mi, mountpoint) != 3) {
+            continue;
+        }
+        // btrfs shows an anonymous device number, so check the source too
+        if ((makedev(ma, mi) == dev)
+            || ((fields != NULL)
+                && (sscanf(fields, " - %*s %4095s", source) == 1)
+                && (stat(source, &st) == 0) && S_ISBLK(st.st_mode)
+                && (st.st_rdev == dev))) {
+            asprintf(&why, "mounted on %s", mountpoint);
+        }
+    }
+    fclose(f);
+    if ((why == NULL) && ((f = fopen("/proc/swaps", "r")) != NULL)) {
+        while ((why == NULL) && (fgets(line, sizeof(line), f) != NULL)) {
+            char path[PATH_MAX];
+            struct stat st;
+            if ((sscanf(line, "%4095s", path) == 1) && (stat(path, &st) == 0)
+                && S_ISBLK(st.st_mode) && (st.st_rdev == dev)) {
+                why = strdup("used for swap");
+            }
+        }
+        fclose(f);
+    }
+    char holders[PATH_MAX];
+    DIR * d = NULL;
+    if (why != NULL) {
+        return why;
+    } else if (dir[0] == '\0') {
+        return NULL; // no sysfs, so no holders we can see
+    } else if (snprintf(holders, sizeof(holders), "%s/holders", dir)
+               >= sizeof(holders)) {
+        return strdup("impossible to check: its sysfs path is too long");
+    }
+    d = opendir(holders);
+    struct dirent * e;
+    while ((why == NULL) && (d != NULL) && ((e = readdir(d)) != NULL)) {
+        if (e->d_name[0] == '.') {
+            continue;
+        }
+        char holder[PATH_MAX];
+        char name[NAME_MAX + 1];
+        if (snprintf(holder, sizeof(holder), "%s/%s", holders, e->d_name)
+            >= sizeof(holder)) {
+            why = strdup("impossible to check: its sysfs path is too long");
+            break;
+        }
+        snprintf(line, sizeof(line), "%s/dm", holder);
+        sysfsstring(line, "name", name, sizeof(name), e->d_name);
+        char * held = inuse(sysfsdev(holder), holder);
+        asprintf(&why, "held by %s%s%s", name, held ? ", which is " : "",
+                 held ? held : "");
+        free(held);
+    }
+    if (d != NULL) {
+        closedir(d);
+    }
+    return why;
+}
+
+/* Find out which partitions of the device are busy. If the whole device is
+ * busy, or the device is a partition which is busy or is on a disk which
+ * is, all of it is treated as busy: the read-only modes can go ahead, but
+ * nothing will write to it.
+ */
+void findbusy(unsigned long long totalsize) {
+    struct stat st;
+    if (fstat(disk.fd, &st) != 0) {
+        printf("Error getting status of %s: %s\n", filename, strerror(errno));
+        exit(-1);
+    }
+    // A partition's own sysfs directory, for its holders
+    char path[64];
+    char self[PATH_MAX];
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u",
+             major(st.st_rdev), minor(st.st_rdev));
+    if (realpath(path, self) == NULL) {
+        self[0] = '\0';
+    }
+    int partition = sysfsdev(disk.topo.sysdir) != st.st_rdev;
+    char * why = inuse(st.st_rdev, self);
+    if ((why == NULL) && partition) {
+        why = inuse(sysfsdev(disk.topo.sysdir), disk.topo.sysdir);
+    }
+    if (why != NULL) {
+        printf("%s is %s: nothing will be written to it\n", filename, why);
+        devicebusy = why;
+        addextent(&busy, &nbusy, 0, totalsize);
+        return;
+    }
+    if (partition) {
+        return; // the other partitions on its disk are outside it
+    }
+    DIR * d = opendir(disk.topo.sysdir);
+    struct dirent * e;
+    while ((d != NULL) && ((e = readdir(d)) != NULL)) {
+        char dir[PATH_MAX];
+        if (snprintf(dir, sizeof(dir), "%s/%s", disk.topo.sysdir, e->d_name)
+            >= sizeof(dir)) {
+            printf("The sysfs path of %s in %s is too long to check\n",
+                   e->d_name, disk.topo.sysdir);
+            exit(-1);
+        }
+        if ((e->d_name[0] == '.') || (sysfsnumber(dir, "partition", 0) == 0)) {
+            continue;
+        }
+        parts = realloc(parts, (nparts + 1) * sizeof(parts[0]));
+        if (parts == NULL) {
+            printf("Out of memory\n");
+            exit(-1);
+        }
+        struct partition * p = parts + nparts++;
+        snprintf(p->name, sizeof(p->name), "%s", e->d_name);
+        p->dev = sysfsdev(dir);
+        p->start = sysfsnumber(dir, "start", 0) * 512;
+        p->end = p->start + sysfsnumber(dir, "size", 0) * 512;
+        p->claim = -1;
+        p->busy = inuse(p->dev, dir);
+        if (p->busy != NULL) {
+            printf("%s is %s: the size test will not write there\n",
+                   p->name, p->busy);
+            addextent(&busy, &nbusy, p->start, p->end);
+        }
+        // The kernel's idea of the partition should match the table's
+        int i;
+        for (i = 0; (i < nused) && !((used[i].start <= p->start)
+                                      && (used[i].end >= p->end)); ++i) {}
+        if (layoutknown && (i == nused)) {
+            printf("The kernel thinks %s is at %ld to %ld, which is not in the partition table\n",
+                   p->name, p->start, p->end);
+            printf("The size test will not write there either\n");
+            addextent(&busy, &nbusy, p->start, p->end);
+        }
+    }
+    if (d != NULL) {
+        closedir(d);
+    }
+}
+
+/* Claim the whole target before a test which may write anywhere on it.
+ * This also catches users which inuse() can't see, as anything mounted
+ * holds its device exclusively. The claim lasts until we exit.
+ */
+void claimdevice(char * purpose) {
+    if ((disk.backend != BACKENDDEVICE) || (deviceclaim >= 0)) {
+        return;
+    }
+    deviceclaim = open(filename, O_RDONLY|O_EXCL);
+    if (deviceclaim < 0) {
+        printf("Cannot claim %s for %s: %s\n", filename, purpose,
+               strerror(errno));
+        exit(-1);
+    }
+}
+
+/* Claim every partition a probe writes in, so that it can't be mounted
+ * while we're testing. The claims last until we exit.
+ */
+void claimpartitions(off_t * addresses, int n) {
+    if (deviceclaim >= 0) {
+        return; // we have all of it already
+    }
+    for (int i = 0; i < n; ++i) {
+        off_t address = (addresses[i] / blocksize - 1) * blocksize;
+        for (int k = 0; k < nparts; ++k) {
+            struct partition * p = parts + k;
+            if ((p->claim >= 0) || (address < p->start) || (address >= p->end)) {
+                continue;
+            }
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "/dev/%s", p->name);
+            p->claim = open(path, O_RDONLY|O_EXCL);
+            if (p->claim < 0) {
+                printf("Cannot claim %s for the size test: %s\n",
+                       path, strerror(errno));
+                exit(-1);
+            }
+        }
+    }
+}
+
+// Give up our claims, for when we need the whole device to ourselves
+void releasepartitions() {
+    for (int k = 0; k < nparts; ++k) {
+        if (parts[k].claim >= 0) {
+            close(parts[k].claim);
+            parts[k].claim = -1;
+        }
+    }
+}
+
+/* Filesystems in the partitions. Knowing what's in a partition tells us
+ * what we'd be risking, and for ext2/3/4 and FAT we can read the free
+ * space maps and let probes use blocks which the filesystem isn't using,
+ * so they need no save and restore. Every step is done for all the
+ * partitions in one batch: first the superblock areas, then the ext group
+ * descriptors and the FATs, then the ext block bitmaps.
+ * Busy partitions are left alone: their free space can change under us.
+ * If the device stops responding we stop too, and know only the layout.
+ */
+#define FSHEAD 4096 // what we read from the start of each partition
+#define BTRFSSUPER (64 * 1024) // btrfs superblock offset
+#define MAXFATREAD (16 * 1024 * 1024) // biggest FAT we will read
+#define MAXBITMAPS 1024 // ext block bitmaps we will read per filesystem
+
+struct filesystem {
+    off_t start; // of the partition
+    off_t end;
+    char * type; // NULL if we don't recognise it
+    unsigned char * head; // first FSHEAD bytes
+    unsigned char * btrfs; // FSHEAD bytes at BTRFSSUPER
+    unsigned char * map; // ext group descriptors or the first FAT
+    size_t mapsize;
+    off_t freebytes; // free space we found and can use
+    // ext only
+    size_t extblock;
+    uint64_t extgroups;
+    uint32_t extpergroup; // blocks
+    uint32_t extbits; // bits in each group's bitmap
+    size_t extunit; // bytes each bit stands for, a cluster with bigalloc
+    uint32_t extfirst;
+    size_t extdesc;
+    unsigned char * bitmaps; // the bitmaps we read, one block each
+};
+
+void markfree(off_t start, off_t end) {
+    for (int i = 0; i < nused; ++i) {
+        struct extent * u = used + i;
+        if ((end <= u->start) || (start >= u->end)) {
+            continue;
+        }
+        if ((start > u->start) && (end < u->end)) {
+            off_t tail = u->end;
+            u->end = start;
+            addextent(&used, &nused, end, tail); // may move used[]
+            return;
+        }
+        if ((start <= u->start) && (end >= u->end)) {
+            memmove(used + i, used + i + 1, (nused - i - 1) * sizeof(used[0]));
+            --nused;
+            --i;
+        } else if (start <= u->start) {
+            u->start = end;
+        } else {
+            u->end = start;
+        }
+    }
+}
+
+// Mark a run of free filesystem space, keeping whole logical blocks
+void fsfree(struct filesystem * f, off_t start, off_t end) {
+    start = (start + blocksize - 1) / blocksize * blocksize;
+    end = end / blocksize * blocksize;
+    if ((end > start) && (end <= f->end)) {
+        markfree(start, end);
+        f->freebytes += end - start;
+    }
+}
+
+void fsidentify(struct filesystem * f) {
+    unsigned char * h = f->head;
+    if (memcmp(h, "XFSB", 4) == 0) {
+        f->type = "XFS";
+    } else if (memcmp(h, "LUKS\xba\xbe", 6) == 0) {
+        f->type = "LUKS encrypted";
+    } else if (memcmp(h + 3, "NTFS    ", 8) == 0) {
+        f->type = "NTFS";
+    } else if (memcmp(h + 3, "EXFAT   ", 8) == 0) {
+        f->type = "exFAT";
+    } else if ((*(uint16_t *)(h + 1080) == 0xEF53)) {
+        uint32_t incompat = *(uint32_t *)(h + 1024 + 0x60);
+        f->type = (incompat & 0x2C0) ? "ext4" // extents, 64bit or flex_bg
+                  : (*(uint32_t *)(h + 1024 + 0x5C) & 0x4) ? "ext3" : "ext2";
+    } else if ((memcmp(h + 4086, "SWAPSPACE2", 10) == 0)
+               || (memcmp(h + 4086, "SWAP-SPACE", 10) == 0)) {
+        f->type = "swap";
+    } else if ((f->btrfs != NULL) && (memcmp(f->btrfs + 64, "_BHRfS_M", 8) == 0)) {
+        f->type = "btrfs";
+    } else if ((*(uint16_t *)(h + 510) == MBRSIGNATURE)
+               && ((memcmp(h + 54, "FAT", 3) == 0)
+                   || (memcmp(h + 82, "FAT32", 5) == 0))) {
+        f->type = "FAT";
+    }
+}
+
+// Set up the read of the ext group descriptors, returns 0 if we can't use them
+int extprepare(struct filesystem * f, struct ioreq * r) {
+    unsigned char * sb = f->head + 1024;
+    uint32_t incompat = *(uint32_t *)(sb + 0x60);
+    if (incompat & 0x14) {
+        return 0; // needs journal recovery, or META_BG group descriptors
+    }
+    uint32_t logblock = *(uint32_t *)(sb + 0x18);
+    uint32_t logcluster = *(uint32_t *)(sb + 0x1C);
+    if (logblock > 6) {
+        return 0;
+    }
+    f->extblock = 1024 << logblock;
+    f->extfirst = *(uint32_t *)(sb + 0x14);
+    f->extpergroup = *(uint32_t *)(sb + 0x20);
+    f->extbits = f->extpergroup;
+    f->extunit = f->extblock;
+    if (*(uint32_t *)(sb + 0x64) & 0x200) {
+        // bigalloc: the bitmaps have a bit per cluster
+        if ((logcluster < logblock) || (logcluster > 20)) {
+            return 0;
+        }
+        f->extbits = *(uint32_t *)(sb + 0x24);
+        f->extunit = 1024 << logcluster;
+    }
+    uint64_t blocks = *(uint32_t *)(sb + 0x4);
+    f->extdesc = 32;
+    if (incompat & 0x80) {
+        blocks |= (uint64_t)*(uint32_t *)(sb + 0x150) << 32;
+        f->extdesc = *(uint16_t *)(sb + 0xFE);
+    }
+    if ((f->extpergroup == 0) || (f->extblock > 65536) || (f->extdesc < 32)
+        || (f->extblock % blocksize != 0) || (f->extbits > f->extblock * 8)
+        || ((uint64_t)f->extbits * f->extunit
+            != (uint64_t)f->extpergroup * f->extblock)) {
+        return 0;
+    }
+    f->extgroups = (blocks - f->extfirst + f->extpergroup - 1) / f->extpergroup;
+    f->mapsize = (f->extgroups * f->extdesc + f->extblock - 1)
+                 / f->extblock * f->extblock;
+    if (f->mapsize > MAXFATREAD) {
+        return 0;
+    }
+    f->map = iobuffer(f->mapsize);
+    // in the block after the superblock's, which bigalloc may put in block 0
+    ioprepare(r, &disk, IOREAD,
+              f->start + (off_t)(1024 / f->extblock + 1) * f->extblock,
+              f->map, f->mapsize);
+    return 1;
+}
+
+// Which groups' bitmaps we read: all of them, or an even sample
+uint64_t extstep(struct filesystem * f) {
+    return (f->extgroups + MAXBITMAPS - 1) / MAXBITMAPS;
+}
+
+int extbitmaps(struct filesystem * f, struct ioreq * r) {
+    uint64_t step = extstep(f);
+    int n = 0;
+    f->bitmaps = iobuffer(((f->extgroups + step - 1) / step) * f->extblock);
+    for (uint64_t g = 0; g < f->extgroups; g += step, ++n) {
+        unsigned char * d = f->map + g * f->extdesc;
+        uint64_t bitmap = *(uint32_t *)d;
+        if (f->extdesc >= 64) {
+            bitmap |= (uint64_t)*(uint32_t *)(d + 0x20) << 32;
+        }
+        if (*(uint16_t *)(d + 0x12) & 0x1) {
+            bitmap = 0; // BLOCK_UNINIT: no bitmap on disk, leave it alone
+        }
+        ioprepare(r + n, &disk, IOREAD, f->start + bitmap * f->extblock,
+                  f->bitmaps + n * f->extblock, f->extblock);
+        if (bitmap == 0) {
+            r[n].cb.aio_nbytes = 0;
+        }
+    }
+    return n;
+}
+
+void extfree(struct filesystem * f, struct ioreq * r, int n) {
+    uint64_t step = extstep(f);
+    for (int k = 0; k < n; ++k) {
+        if ((r[k].cb.aio_nbytes == 0) || (r[k].result != f->extblock)) {
+            continue;
+        }
+        unsigned char * bits = f->bitmaps + k * f->extblock;
+        off_t first = f->start + (f->extfirst + (uint64_t)k * step
+                                  * f->extpergroup) * f->extblock;
+        uint64_t run = 0;
+        for (uint32_t b = 0; b <= f->extbits; ++b) {
+            if ((b < f->extbits) && !(bits[b / 8] & (1 << (b % 8)))) {
+                ++run;
+            } else if (run > 0) {
+                fsfree(f, first + (b - run) * f->extunit,
+                       first + b * f->extunit);
+                run = 0;
+            }
+        }
+    }
+}
+
+int fatprepare(struct filesystem * f, struct ioreq * r) {
+    unsigned char * h = f->head;
+    uint16_t bps = *(uint16_t *)(h + 11);
+    uint16_t reserved = *(uint16_t *)(h + 14);
+    uint32_t fatsize = *(uint16_t *)(h + 22);
+    if (fatsize == 0) {
+        fatsize = *(uint32_t *)(h + 36);
+    }
+    if ((bps < 512) || (bps % blocksize != 0) || (h[13] == 0) || (h[16] == 0)) {
+        return 0;
+    }
+    f->mapsize = (size_t)fatsize * bps;
+    if ((f->mapsize == 0) || (f->mapsize > MAXFATREAD)) {
+        return 0;
+    }
+    f->map = iobuffer(f->mapsize);
+    ioprepare(r, &disk, IOREAD, f->start + (off_t)reserved * bps,
+              f->map, f->mapsize);
+    return 1;
+}
+
+void fatfree(struct filesystem * f) {
+    unsigned char * h = f->head;
+    uint16_t bps = *(uint16_t *)(h + 11);
+    uint8_t spc = h[13];
+    uint32_t total = *(uint16_t *)(h + 19);
+    if (total == 0) {
+        total = *(uint32_t *)(h + 32);
+    }
+    uint32_t rootsectors = (*(uint16_t *)(h + 17) * 32 + bps - 1) / bps;
+    uint32_t data = *(uint16_t *)(h + 14) + h[16] * (f->mapsize / bps)
+                    + rootsectors;
+    if (total <= data) {
+        return;
+    }
+    uint32_t clusters = (total - data) / spc;
+    int bits = clusters < 4085 ? 12 : clusters < 65525 ? 16 : 32;
+    // the last entry we read, for cluster clusters + 1, must be in the FAT
+    if ((uint64_t)(clusters + 1) * bits / 8 + ((bits == 12) ? 2 : bits / 8)
+        > f->mapsize) {
+        return;
+    }
+    off_t base = f->start + (off_t)data * bps;
+    size_t csize = (size_t)spc * bps;
+    uint32_t run = 0;
+    for (uint32_t c = 2; c <= clusters + 2; ++c) {
+        uint32_t entry = 1;
+        if (c < clusters + 2) {
+            if (bits == 12) {
+                uint16_t v = *(uint16_t *)(f->map + c * 3 / 2);
+                entry = (c & 1) ? v >> 4 : v & 0xFFF;
+            } else if (bits == 16) {
+                entry = *(uint16_t *)(f->map + c * 2);
+            } else {
+                entry = *(uint32_t *)(f->map + c * 4) & 0x0FFFFFFF;
+            }
+        }
+        if (entry == 0) {
+            ++run;
+        } else if (run > 0) {
+            fsfree(f, base + (off_t)(c - 2 - run) * csize,
+                   base + (off_t)(c - 2) * csize);
+            run = 0;
+        }
+    }
+}
+
+void filesystems() {
+    struct filesystem * fs = calloc(nplist, sizeof(*fs));
+    struct ioreq * reqs = calloc(2 * nplist, sizeof(*reqs));
+    if ((nplist > 0) && ((fs == NULL) || (reqs == NULL))) {
+        printf("Out of memory\n");
+        exit(-1);
+    }
+    int n = 0;
+    for (int i = 0; i < nplist; ++i) {
+        struct filesystem * f = fs + i;
+        f->start = plist[i].start;
+        f->end = plist[i].end;
+        if (overlaps(busy, nbusy, f->start, f->end - f->start)
+            || (f->end - f->start < 2 * FSHEAD)) {
+            continue;
+        }
+        f->head = iobuffer(FSHEAD);
+        ioprepare(reqs + n++, &disk, IOREAD, f->start, f->head, FSHEAD);
+        if (f->end - f->start >= BTRFSSUPER + FSHEAD) {
+            f->btrfs = iobuffer(FSHEAD);
+            ioprepare(reqs + n++, &disk, IOREAD, f->start + BTRFSSUPER,
+                      f->btrfs, FSHEAD);
+        }
+    }
+    if (iobatch(reqs, n) != 0) {
+        return; // a hung device: leave the buffers to it, know nothing more
+    }
+    n = 0;
+    for (int i = 0; i < nplist; ++i) {
+        struct filesystem * f = fs + i;
+        if (f->head != NULL) {
+            if ((reqs[n].result == FSHEAD)
+                && ((f->btrfs == NULL) || (reqs[n + 1].result == FSHEAD))) {
+                fsidentify(f);
+            }
+            n += 1 + (f->btrfs != NULL);
+        }
+    }
+    // Second batch: the ext group descriptors and the FATs
+    n = 0;
+    for (int i = 0; i < nplist; ++i) {
+        struct filesystem * f = fs + i;
+        if (f->type == NULL) {
+            continue;
+        }
+        if (strncmp(f->type, "ext", 3) == 0) {
+            n += extprepare(f, reqs + n);
+        } else if (strcmp(f->type, "FAT") == 0) {
+            n += fatprepare(f, reqs + n);
+        }
+    }
+    if (iobatch(reqs, n) != 0) {
+        return; // a hung device: leave the buffers to it, know nothing more
+    }
+    // Third batch: the ext block bitmaps
+    int nb = 0;
+    struct ioreq * breqs = NULL;
+    for (int i = 0, k = 0; i < nplist; ++i) {
+        struct filesystem * f = fs + i;
+        if (f->map == NULL) {
+            continue;
+        }
+        if (reqs[k++].result != f->mapsize) {
+            free(f->map);
+            f->map = NULL;
+        } else if (strcmp(f->type, "FAT") == 0) {
+            fatfree(f);
+        } else {
+            breqs = realloc(breqs, (nb + MAXBITMAPS) * sizeof(*breqs));
+            if (breqs == NULL) {
+                printf("Out of memory\n");
+                exit(-1);
+            }
+            nb += extbitmaps(f, breqs + nb);
+        }
+    }
+    if (nb > 0) {
+        // requests with nothing to read are for groups without bitmaps
+        struct ioreq * live[nb];
+        struct ioreq * packed = calloc(nb, sizeof(*packed));
+        int nl = 0;
+        for (int k = 0; k < nb; ++k) {
+            if (breqs[k].cb.aio_nbytes != 0) {
+                live[nl] = breqs + k;
+                packed[nl++] = breqs[k];
+            }
+        }
+        if (iobatch(packed, nl) != 0) {
+            return;
+        }
+        for (int k = 0; k < nl; ++k) {
+            live[k]->result = packed[k].result;
+        }
+        free(packed);
+    }
+    for (int i = 0, k = 0; i < nplist; ++i) {
+        struct filesystem * f = fs + i;
+        if ((f->map != NULL) && (f->bitmaps != NULL)) {
+            int groups = (f->extgroups + extstep(f) - 1) / extstep(f);
+            extfree(f, breqs + k, groups);
+            k += groups;
+        }
+        if (f->type != NULL) {
+            printf("Partition from %ld to %ld holds %s%s", f->start, f->end,
+                   f->type, (f->map != NULL) ? "" : "\n");
+            if (f->map != NULL) {
+                printf(", %ld bytes%s known to be free\n", f->freebytes,
+                       human(f->freebytes));
+            }
+        }
+        free(f->head);
+        free(f->btrfs);
+        free(f->map);
+        free(f->bitmaps);
+    }
+    free(breqs);
+    free(reqs);
+    free(fs);
+}
+
+/* Move each probe to the nearest free block which still has the same top
+ * address bit (so it still tests the same address line) and which stays
+ * between its neighbours (so the probes still walk up the device). A probe
+ * in a busy partition must move, if need be into an idle partition, and is
+ * dropped if it can't. addresses[] are one block past where each probe
+ * writes.
+ */
+int placeprobes(off_t * addresses, off_t * modulos, int * n,
+                unsigned long long totalsize) {
+    int moved = 0;
+    for (int i = 0; i < *n; ++i) {
+        off_t address = (addresses[i] / blocksize - 1) * blocksize;
+        int inbusy = overlaps(busy, nbusy, address, blocksize);
+        if (!inbusy && (!layoutknown || isfree(address, blocksize))) {
+            continue;
+        }
+        off_t lo = (i > 0) ? addresses[i - 1] : 0;
+        off_t hi = (i + 1 < *n) ? addresses[i + 1] - blocksize : totalsize;
+        if (lo < modulos[i]) { lo = modulos[i]; }
+        if (hi > 2 * modulos[i]) { hi = 2 * modulos[i]; }
+        off_t block = layoutknown ? nearestgap(used, nused, address, lo, hi) : -1;
+        if ((block < 0) && inbusy) {
+            block = nearestgap(busy, nbusy, address, lo, hi);
+        }
+        if (block >= 0) {
+            addresses[i] = block + blocksize;
+            ++moved;
+        } else if (inbusy) {
+            printf("Skipping the probe at %ld because it is in a busy partition\n",
+                   address);
+            --*n;
+            memmove(addresses + i, addresses + i + 1, (*n - i) * sizeof(off_t));
+            memmove(modulos + i, modulos + i + 1, (*n - i) * sizeof(off_t));
+            --i;
+        }
+    }
+    return moved;
+}
+
+/* Bad regions found by the tests, one sorted extent list per kind of
+ * failure so that neighbouring bad blocks coalesce into one extent. Memory
+ * grows with the number of separate bad regions, not with the size of the
+ * device. At exit they are summarised and, if asked, written out as a
+ * badblocks list (for e2fsck -l or mke2fs -l, in logical blocks) and as a
+ * binary map which keeps the kinds.
+ */
+#define BADREAD 0 // reads fail
+#define BADWRITE 1 // writes or the sync after them fail
+#define BADDATA 2 // reads back something other than what was written
+#define BADALIAS 3 // writing somewhere else changes it
+#define BADSLOW 4 // works, but an I/O took longer than SLOWIO
+#define NBADKINDS 5
+#define SLOWIO 1.0 // seconds for one block
+#define BADMAPMAGIC "DSBADMAP"
+
+char * badkinds[NBADKINDS] = {
+    "read errors", "write errors", "wrong data", "aliasing", "slow I/O"
+};
+struct extent * bad[NBADKINDS];
+int nbad[NBADKINDS];
+char * badblocksfile; // --badblocks
+char * badmapfile; // --badmap
+unsigned long long badsize; // size of the device the map is for
+
+struct badmapheader {
+    char magic[8];
+    uint32_t version;
+    uint32_t blocksize;
+    uint64_t devsize;
+    uint64_t count; // of struct badmaprecord following
+};
+
+struct badmaprecord {
+    uint64_t start;
+    uint64_t end;
+    uint32_t kind;
+    uint32_t reserved;
+};
+
+void markbad(int kind, off_t start, off_t end) {
+    addextent(&bad[kind], &nbad[kind], start, end);
+}
+
+// Write a badblocks list of every block with a hard failure
+void savebadblocks(char * name) {
+    struct extent * all = NULL;
+    int nall = 0;
+    for (int k = 0; k < NBADKINDS; ++k) {
+        for (int i = 0; (k != BADSLOW) && (i < nbad[k]); ++i) {
+            addextent(&all, &nall, bad[k][i].start, bad[k][i].end);
+        }
+    }
+    FILE * f = fopen(name, "w");
+    if (f == NULL) {
+        openerror(name);
+        return;
+    }
+    for (int i = 0; i < nall; ++i) {
+        for (off_t b = all[i].start / blocksize;
+             b < (all[i].end + blocksize - 1) / blocksize; ++b) {
+            fprintf(f, "%ld\n", b);
+        }
+    }
+    if (fclose(f) != 0) {
+        printf("Error writing %s: %s\n", name, strerror(errno));
+    }
+    free(all);
+}
+
+void savebadmap(char * name) {
+    struct badmapheader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, BADMAPMAGIC, sizeof(h.magic));
+    h.version = 1;
+    h.blocksize = blocksize;
+    h.devsize = badsize;
+    for (int k = 0; k < NBADKINDS; ++k) {
+        h.count += nbad[k];
+    }
+    FILE * f = fopen(name, "w");
+    if (f == NULL) {
+        openerror(name);
+        return;
+    }
+    fwrite(&h, sizeof(h), 1, f);
+    for (int k = 0; k < NBADKINDS; ++k) {
+        for (int i = 0; i < nbad[k]; ++i) {
+            struct badmaprecord r = { bad[k][i].start, bad[k][i].end, k, 0 };
+            fwrite(&r, sizeof(r), 1, f);
+        }
+    }
+    if (fclose(f) != 0) {
+        printf("Error writing %s: %s\n", name, strerror(errno));
+    }
+}
+
+// Called at exit, so that we keep what we found however the test ends
+void badreport() {
+    for (int k = 0; k < NBADKINDS; ++k) {
+        off_t bytes = 0;
+        for (int i = 0; i < nbad[k]; ++i) {
+            bytes += bad[k][i].end - bad[k][i].start;
+        }
+        if (nbad[k] > 0) {
+            printf("%s: %s in %d region%s, %ld bytes%s\n", filename,
+                   badkinds[k], nbad[k], (nbad[k] == 1) ? "" : "s",
+                   bytes, human(bytes));
+        }
+    }
+    if (badblocksfile != NULL) {
+        savebadblocks(badblocksfile);
+    }
+    if (badmapfile != NULL) {
+        savebadmap(badmapfile);
+    }
+}
+
+/* One block I/O for the tests, with a sync after a write. Failures and
+ * slow I/Os go in the bad region map, and an I/O which the device never
+ * finishes is both; once the device has stopped responding the block is
+ * left untested. Returns 0 if the I/O worked.
+ */
+int testio(int op, off_t address, void * buf) {
+    if (disk.failed) {
+        return -1;
+    }
+    double took;
+    ssize_t result = singleio(op, address, buf, blocksize, &took);
+    if ((op == IOWRITE) && (result == blocksize)) {
+        result = singleio(IOSYNC, 0, NULL, 0, NULL);
+        result = (result < 0) ? result : blocksize;
+    }
+    int kind = (op == IOREAD) ? BADREAD : BADWRITE;
+    if (result < 0) {
+        printf("%s %lu bytes at offset %ld on %s failed: %s\n",
+               (op == IOREAD) ? "Reading" : "Writing", blocksize, address,
+               filename, strerror(-result));
+    } else if (result != blocksize) {
+        printf("%s %lu bytes at offset %ld on %s transferred %ld bytes instead\n",
+               (op == IOREAD) ? "Reading" : "Writing", blocksize, address,
+               filename, result);
+    } else {
+        if (took > SLOWIO) {
+            markbad(BADSLOW, address, address + blocksize);
+        }
+        return 0;
+    }
+    if (result == -ETIMEDOUT) {
+        markbad(BADSLOW, address, address + blocksize);
+    }
+    markbad(kind, address, address + blocksize);
+    return -1;
+}
+
+/* What we have learnt about each device we have seen, so that the same
+ * devices going through intake or audit again and again don't need the
+ * same work every time: the calibrated I/O settings, and the result of the
+ * last size test with what the device looked like then. The cache file has
+ * a line per device, its identity and then field=value pairs. Devices are
+ * known by their WWN if they have one, otherwise by model and serial
+ * number, from udev's database or failing that from sysfs; loop devices by
+ * the file behind them and image files by their path. A device with no WWN
+ * and no serial number isn't cached at all: cheap fakes often have neither.
+ */
+#define CACHEFILE "/var/cache/disksize/devices"
+#define MAXCACHELINE 4096
+
+char * cachefile = CACHEFILE;
+char cacheid[PATH_MAX]; // the device's identity, "" if it hasn't one
+char cachefields[MAXCACHELINE]; // " field=value" for each thing we know
+char devmodel[64];
+char devserial[64];
+char devwwn[64];
+// what the last size test found, and what the device looked like then
+uint32_t layouthash; // of the MBR and the GPT header, which covers the entries
+off_t proven; // end of the highest probe block which has passed
+unsigned long long testedsize;
+int screened; // what the screen found, as screen() returns it
+char * cachetest; // size, budget or sample
+char * cacheverdict; // passed, failed, rejected or undecided
+
+// The cache file separates fields with spaces
+void nospaces(char * s) {
+    for ( ; *s != '\0'; ++s) {
+        if ((*s == ' ') || (*s == '\t')) {
+            *s = '_';
+        }
+    }
+}
+
+// A property from udev's database entry for a device, or "" if it has none
+void udevproperty(char * devnum, char * name, char * value, int size) {
+    char path[PATH_MAX];
+    char line[512];
+    snprintf(path, sizeof(path), "/run/udev/data/b%s", devnum);
+    value[0] = '\0';
+    FILE * f = fopen(path, "r");
+    if (f == NULL) {
+        return;
+    }
+    size_t n = strlen(name);
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if ((strncmp(line, "E:", 2) == 0) && (strncmp(line + 2, name, n) == 0)
+            && (line[2 + n] == '=')) {
+            line[strcspn(line, "\n")] = '\0';
+            snprintf(value, size, "%s", line + 3 + n);
+            break;
+        }
+    }
+    fclose(f);
+}
+
+/* Find the device's model, serial number and WWN, and from them something
+ * which names the device itself rather than where it happens to be
+ * plugged in, or "" if we can't tell.
+ */
+void deviceid(struct iodev * dev, char * id, int size) {
+    char path[PATH_MAX];
+    char devnum[32];
+    id[0] = devmodel[0] = devserial[0] = devwwn[0] = '\0';
+    if (dev->backend == BACKENDFILE) {
+        if (realpath(dev->name, path) != NULL) {
+            snprintf(id, size, "file:%s", path);
+        }
+    } else if ((dev->backend == BACKENDDEVICE) && (dev->topo.sysdir[0] != '\0')) {
+        char * sysdir = dev->topo.sysdir;
+        sysfsstring(sysdir, "dev", devnum, sizeof(devnum), "");
+        udevproperty(devnum, "ID_MODEL", devmodel, sizeof(devmodel));
+        if (devmodel[0] == '\0') {
+            sysfsstring(sysdir, "device/model", devmodel, sizeof(devmodel), "");
+        }
+        udevproperty(devnum, "ID_SERIAL_SHORT", devserial, sizeof(devserial));
+        if (devserial[0] == '\0') {
+            sysfsstring(sysdir, "device/serial", devserial, sizeof(devserial), "");
+        }
+        if (devserial[0] == '\0') {
+            sysfsstring(sysdir, "serial", devserial, sizeof(devserial), "");
+        }
+        udevproperty(devnum, "ID_WWN_WITH_EXTENSION", devwwn, sizeof(devwwn));
+        if (devwwn[0] == '\0') {
+            udevproperty(devnum, "ID_WWN", devwwn, sizeof(devwwn));
+        }
+        if (devwwn[0] == '\0') {
+            sysfsstring(sysdir, "wwid", devwwn, sizeof(devwwn), ""); // NVMe
+        }
+        if (devwwn[0] == '\0') {
+            sysfsstring(sysdir, "device/wwid", devwwn, sizeof(devwwn), ""); // SCSI
+        }
+        nospaces(devmodel);
+        nospaces(devserial);
+        nospaces(devwwn);
+        sysfsstring(sysdir, "loop/backing_file", path, sizeof(path), "");
+        if (devwwn[0] != '\0') {
+            snprintf(id, size, "wwn:%s", devwwn);
+        } else if (path[0] != '\0') {
+            snprintf(id, size, "loop:%s", path);
+        } else if (devserial[0] != '\0') {
+            snprintf(id, size, "%s:%s", devmodel, devserial);
+        } else {
+            // a model alone would let one good unit vouch for every other
+            printf("%s has no WWN or serial number, so it can't be cached\n",
+                   dev->name);
+        }
+        // a partition is a different thing to test from its whole disk
+        struct stat st;
+        if ((id[0] != '\0') && (fstat(dev->fd, &st) == 0)
+            && (st.st_rdev != sysfsdev(sysdir))) {
+            char part[64];
+            snprintf(part, sizeof(part), "/sys/dev/block/%u:%u",
+                     major(st.st_rdev), minor(st.st_rdev));
+            size_t len = strlen(id);
+            snprintf(id + len, size - len, "@%lld+%lld",
+                     sysfsnumber(part, "start", 0) * 512,
+                     sysfsnumber(part, "size", 0) * 512);
+        }
+    }
+    nospaces(id);
+}
+
+// Find what the cache knows about a device
+void cacheload(struct iodev * dev) {
+    deviceid(dev, cacheid, sizeof(cacheid));
+    if ((devmodel[0] != '\0') || (devserial[0] != '\0') || (devwwn[0] != '\0')) {
+        printf("%s is model %s, serial number %s, WWN %s\n", dev->name,
+               devmodel[0] ? devmodel : "unknown",
+               devserial[0] ? devserial : "unknown",
+               devwwn[0] ? devwwn : "unknown");
+    }
+    cachefields[0] = '\0';
+    FILE * f = (cacheid[0] != '\0') ? fopen(cachefile, "r") : NULL;
+    if (f == NULL) {
+        return;
+    }
+    char line[MAXCACHELINE];
+    size_t n = strlen(cacheid);
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        if ((strncmp(line, cacheid, n) == 0) && (line[n] == ' ')) {
+            snprintf(cachefields, sizeof(cachefields), "%s", line + n);
+        }
+    }
+    fclose(f);
+}
+
+// Returns 1 and copies the value if the cache has the field
+int cacheget(char * field, char * value, int size) {
+    char key[64];
+    snprintf(key, sizeof(key), " %s=", field);
+    char * p = strstr(cachefields, key);
+    if (p == NULL) {
+        return 0;
+    }
+    p += strlen(key);
+    int n = strcspn(p, " ");
+    snprintf(value, size, "%.*s", n, p);
+    return 1;
+}
+
+void cacheput(char * field, char * value) {
+    char key[64];
+    char rest[MAXCACHELINE];
+    snprintf(key, sizeof(key), " %s=", field);
+    char * p = strstr(cachefields, key);
+    if (p != NULL) {
+        char * end = p + strlen(key);
+        end += strcspn(end, " ");
+        memmove(p, end, strlen(end) + 1);
+    }
+    snprintf(rest, sizeof(rest), "%s", cachefields);
+    snprintf(cachefields, sizeof(cachefields), "%s%s%s", rest, key, value);
+}
+
+/* Write the cache back with this device's line replaced. A cache we can't
+ * write only costs time, so we say so and carry on.
+ */
+void cachesave() {
+    if (cacheid[0] == '\0') {
+        return;
+    }
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", cachefile);
+    char * slash = strrchr(dir, '/');
+    if ((slash != NULL) && (slash != dir)) {
+        *slash = '\0';
+        mkdir(dir, 0755);
+    }
+    if (devmodel[0] != '\0') {
+        cacheput("model", devmodel);
+    }
+    if (devserial[0] != '\0') {
+        cacheput("serial", devserial);
+    }
+    if (devwwn[0] != '\0') {
+        cacheput("wwn", devwwn);
+    }
+    char temp[PATH_MAX];
+    snprintf(temp, sizeof(temp), "%s.new", cachefile);
+    FILE * out = fopen(temp, "w");
+    if (out == NULL) {
+        printf("Can't update the device cache %s: %s\n", temp, strerror(errno));
+        return;
+    }
+    FILE * in = fopen(cachefile, "r");
+    if (in != NULL) {
+        char line[MAXCACHELINE];
+        size_t n = strlen(cacheid);
+        while (fgets(line, sizeof(line), in) != NULL) {
+            if ((strncmp(line, cacheid, n) != 0) || (line[n] != ' ')) {
+                fputs(line, out);
+            }
+        }
+        fclose(in);
+    }
+    fprintf(out, "%s%s\n", cacheid, cachefields);
+    if ((fclose(out) != 0) || (rename(temp, cachefile) != 0)) {
+        printf("Can't update the device cache %s: %s\n", cachefile,
+               strerror(errno));
+        unlink(temp);
+    }
+}
+
+/* The topology only hints at how a device wants to be driven: buffered
+ * I/O wins on some USB bridges, O_DIRECT with io_uring on NVMe, and the
+ * best queue depth varies by orders of magnitude. So before testing we
+ * time each engine, extent size and queue depth for a moment on the
+ * device itself, and keep the fastest for the rest of the run. Reads go to
+ * the start of the device; writes only to free space, putting back what
+ * was there, and not at all if the run promises not to write. What we
+ * chose goes in the device cache, so each device is only calibrated once.
+ */
+#define CALIBRATESPAN (32 * 1024 * 1024) // bytes we read or rewrite
+#define CALIBRATESLICE 0.02 // seconds for each direction of each setting
+#define CALIBRATEOFF 0
+#define CALIBRATECACHED 1 // use the cache if it has an answer
+#define CALIBRATEFORCE 2
+
+const size_t calibrateextents[] = {
+    64 * 1024, 256 * 1024, 1024 * 1024, 4 * 1024 * 1024
+};
+const int calibratedepths[] = { 1, 2, 8, 32 };
+
+// Make sure there is a direct file descriptor for each of depth requests
+void growdirect(struct iodev * dev, int depth) {
+    while ((dev->ndirect > 0) && (dev->ndirect < depth)) {
+        int fd = dup(dev->direct[0]);
+        if (fd < 0) {
+            break;
+        }
+        dev->direct[dev->ndirect++] = fd;
+    }
+}
+
+// Returns 0 if the device can use an engine, setting up its ring if need be
+int setengine(struct iodev * dev, int engine) {
+    if ((engine < 0) || (engine >= NENGINES)
+        || ((engine != ENGINEBUFFERED) && (dev->ndirect == 0))) {
+        return -1;
+    }
+    if ((engine == ENGINEURING) && (dev->ring == NULL)) {
+        dev->ring = malloc(sizeof(*dev->ring));
+        if ((dev->ring == NULL) || (uringsetup(dev->ring, MAXQUEUEDEPTH) != 0)) {
+            free(dev->ring);
+            dev->ring = NULL;
+            return -1;
+        }
+    }
+    dev->engine = engine;
+    return 0;
+}
+
+/* The biggest free stretch we may write, in whole MAXEXTENTs up to *size,
+ * which we set to its length. Returns its start, or -1 if there isn't one.
+ */
+off_t freeregion(off_t * size, unsigned long long totalsize) {
+    off_t best = -1;
+    off_t bestsize = 0;
+    off_t start = 0;
+    for (int i = 0; layoutknown && (i <= nused); ++i) {
+        off_t end = (i < nused) ? used[i].start : totalsize;
+        start = (start + MAXEXTENT - 1) / MAXEXTENT * MAXEXTENT;
+        off_t length = (end - start) / MAXEXTENT * MAXEXTENT;
+        if (length > *size) {
+            length = *size;
+        }
+        if ((length > bestsize) && !overlaps(busy, nbusy, start, length)) {
+            best = start;
+            bestsize = length;
+        }
+        if (i < nused) {
+            start = used[i].end;
+        }
+    }
+    *size = bestsize;
+    return best;
+}
+
+/* Keep the device's queue full of extent sized requests, going round the
+ * span starting at address, with buffers at the same offsets in buf, for
+ * about CALIBRATESLICE seconds. Writes finish with a sync. Returns bytes
+ * per second, or 0 if any I/O failed.
+ */
+double calibrateio(struct iodev * dev, int op, off_t address,
+                   unsigned char * buf, off_t span) {
+    struct ioreq reqs[MAXQUEUEDEPTH];
+    int inflight[MAXQUEUEDEPTH];
+    int n = dev->depth;
+    size_t extent = dev->extent;
+    off_t next = 0;
+    unsigned long long bytes = 0;
+    int ok = 1;
+    double start = now();
+    for (int i = 0; i < n; ++i) {
+        ioprepare(reqs + i, dev, op, address + next, buf + next, extent);
+        iosubmit(reqs + i);
+        inflight[i] = 1;
+        next = (next + extent) % span;
+    }
+    for (int active = n; active > 0; ) {
+        if (iowaitsome(reqs, n, active - 1) != 0) {
+            exit(-1); // the device has stopped responding
+        }
+        for (int i = 0; i < n; ++i) {
+            struct ioreq * r = reqs + i;
+            if (!inflight[i] || (r->completed == 0)) {
+                continue;
+            }
+            inflight[i] = 0;
+            --active;
+            if (r->result == extent) {
+                bytes += extent;
+            } else {
+                ok = 0;
+            }
+            if (ok && (now() - start < CALIBRATESLICE)) {
+                ioprepare(r, dev, op, address + next, buf + next, extent);
+                iosubmit(r);
+                inflight[i] = 1;
+                ++active;
+                next = (next + extent) % span;
+            }
+        }
+    }
+    if (op == IOWRITE) {
+        ioprepare(reqs, dev, IOSYNC, 0, NULL, 0);
+        if (iobatch(reqs, 1) != 0) {
+            exit(-1);
+        }
+        ok = ok && (reqs[0].result == 0);
+    }
+    return ok ? bytes / (now() - start) : 0;
+}
+
+// Use calibrated settings from the cache, returns 0 if it had them
+int calibrationcached(struct iodev * dev, int writes) {
+    char engine[16];
+    char extent[32];
+    char depth[16];
+    char kind[16];
+    if (!cacheget("engine", engine, sizeof(engine))
+        || !cacheget("extent", extent, sizeof(extent))
+        || !cacheget("depth", depth, sizeof(depth))
+        || !cacheget("calibration", kind, sizeof(kind))
+        || (writes && (strcmp(kind, "readwrite") != 0))) {
+        return -1;
+    }
+    size_t e = atol(extent);
+    int d = atoi(depth);
+    int k;
+    for (k = 0; (k < NENGINES) && (strcmp(engine, enginenames[k]) != 0); ++k) {}
+    if ((e < MINEXTENT) || (e > MAXEXTENT) || (e % dev->align != 0)
+        || (d < 1) || (d > MAXQUEUEDEPTH) || (setengine(dev, k) != 0)) {
+        return -1;
+    }
+    dev->extent = e;
+    dev->depth = d;
+    growdirect(dev, d);
+    return 0;
+}
+
+/* Choose the engine, extent size and queue depth for the rest of the run.
+ * writes says whether we may time writes, which we only do once a test
+ * which writes has been accepted; if the settings already came from
+ * timing writes there is nothing more to do then.
+ */
+void calibrate(struct iodev * dev, unsigned long long totalsize, int mode,
+               int writes) {
+    static int timedwrites;
+    char kind[16];
+    if ((mode == CALIBRATEOFF) || (dev->backend == BACKENDSIM)) {
+        return; // the simulator's timings are whatever we asked for
+    }
+    if (dev->failed) {
+        return;
+    }
+    if (writes && timedwrites) {
+        return;
+    }
+    if ((mode == CALIBRATECACHED) && (calibrationcached(dev, writes) == 0)) {
+        timedwrites = cacheget("calibration", kind, sizeof(kind))
+                      && (strcmp(kind, "readwrite") == 0);
+        printf("I/O to %s will use the %s engine, %lu byte extents and %d requests in flight, as calibrated before\n",
+               dev->name, enginenames[dev->engine], dev->extent, dev->depth);
+        return;
+    }
+    off_t span = (CALIBRATESPAN < totalsize) ? CALIBRATESPAN : totalsize;
+    span = span / MAXEXTENT * MAXEXTENT;
+    if (span == 0) {
+        return; // too small to matter
+    }
+    double start = now();
+    // reads cover as much as writes can, so that each setting sees the same
+    off_t where = writes ? freeregion(&span, totalsize) : -1;
+    if (writes && (where < 0) && (mode == CALIBRATECACHED)) {
+        return; // we timed the reads already and can't time writes
+    }
+    if (where < 0) {
+        span = (CALIBRATESPAN < totalsize) ? CALIBRATESPAN : totalsize;
+        span = span / MAXEXTENT * MAXEXTENT;
+    }
+    unsigned char * scratch = iobuffer(span);
+    unsigned char * contents = iobuffer(span);
+    if (where >= 0) {
+        // what is there now, which is what the writes put back
+        struct ioreq r;
+        for (off_t o = 0; (o < span) && (where >= 0); o += MAXEXTENT) {
+            ioprepare(&r, dev, IOREAD, where + o, contents + o, MAXEXTENT);
+            if ((iobatch(&r, 1) != 0) || (r.result != MAXEXTENT)) {
+                where = -1;
+            }
+        }
+    }
+    printf("Calibrating I/O to %s with reads%s\n", dev->name,
+           (where >= 0) ? " and writes"
+           : writes ? " only, as it has no free space we can write"
+                    : " only");
+    int engine = dev->engine;
+    size_t extent = dev->extent;
+    int depth = dev->depth;
+    double best = 0;
+    growdirect(dev, MAXQUEUEDEPTH);
+    for (int e = 0; e < NENGINES; ++e) {
+        if (setengine(dev, e) != 0) {
+            continue;
+        }
+        double ebest = 0;
+        double eread = 0;
+        double ewrite = 0;
+        size_t eextent = 0;
+        int edepth = 0;
+        for (int x = 0; x < sizeof(calibrateextents) / sizeof(calibrateextents[0]); ++x) {
+            for (int d = 0; d < sizeof(calibratedepths) / sizeof(calibratedepths[0]); ++d) {
+                dev->extent = calibrateextents[x];
+                dev->depth = calibratedepths[d];
+                if ((dev->extent % dev->align != 0)
+                    || (dev->extent * dev->depth > span)) {
+                    continue;
+                }
+                double rd = calibrateio(dev, IOREAD, 0, scratch, span);
+                double wr = (where >= 0)
+                            ? calibrateio(dev, IOWRITE, where, contents, span)
+                            : 0;
+                // a harmonic mean, as the tests do about as much of each
+                double score = (where < 0) ? rd
+                               : ((rd > 0) && (wr > 0)) ? 2 / (1 / rd + 1 / wr)
+                                                        : 0;
+                if (score > ebest) {
+                    ebest = score;
+                    eread = rd;
+                    ewrite = wr;
+                    eextent = dev->extent;
+                    edepth = dev->depth;
+                }
+            }
+        }
+        if (ebest == 0) {
+            printf("    %-8s failed\n", enginenames[e]);
+            continue;
+        }
+        printf("    %-8s best with %7lu byte extents and %2d requests in flight: reading %.1f Mibytes/s",
+               enginenames[e], eextent, edepth, eread / (1024 * 1024));
+        if (where >= 0) {
+            printf(", writing %.1f Mibytes/s", ewrite / (1024 * 1024));
+        }
+        printf("\n");
+        if (ebest > best) {
+            best = ebest;
+            engine = e;
+            extent = eextent;
+            depth = edepth;
+        }
+    }
+    free(scratch);
+    free(contents);
+    setengine(dev, engine);
+    dev->extent = extent;
+    dev->depth = depth;
+    if (best == 0) {
+        printf("Calibration of %s failed, so its settings come from its topology\n",
+               dev->name);
+        return;
+    }
+    printf("I/O to %s will use the %s engine, %lu byte extents and %d requests in flight, calibrated in %.3f seconds\n",
+           dev->name, enginenames[engine], extent, depth, now() - start);
+    char value[32];
+    cacheput("engine", (char *)enginenames[engine]);
+    snprintf(value, sizeof(value), "%lu", extent);
+    cacheput("extent", value);
+    snprintf(value, sizeof(value), "%d", depth);
+    cacheput("depth", value);
+    cacheput("calibration", (where >= 0) ? "readwrite" : "read");
+    cachesave();
+    timedwrites = where >= 0;
+}
+
+/* A read-only screen for fake devices, cheap enough to run before we offer
+ * to write anything. Counterfeit controllers often answer reads beyond
+ * their real capacity with constant data, very quickly, or with errors,
+ * or hand back the data at the address with the top bit dropped. We read
+ * a few blocks from each octave of the device, [2^k, 2^(k+1)), together
+ * with the block each would alias to, and compare the high octaves with
+ * the low ones.
+ */
+#define SCREENSTART (1024 * 1024) // first octave
+#define SCREENSAMPLES 8 // blocks read in each octave
+#define SCREENFAST 10.0 // this much faster than the low octaves is odd
+#define MAXOCTAVES 64
+
+struct octave {
+    off_t start;
+    off_t end;
+    int errors;
+    int constant; // blocks all one byte value
+    int aliased; // blocks with varied data, identical to their alias
+    double latency[SCREENSAMPLES];
+    double entropy; // mean, in bits per byte
+};
+
+double entropy(unsigned char * buf, size_t size) {
+    unsigned long counts[256] = { 0 };
+    for (size_t i = 0; i < size; ++i) {
+        ++counts[buf[i]];
+    }
+    double h = 0;
+    for (int v = 0; v < 256; ++v) {
+        if (counts[v] > 0) {
+            double p = (double)counts[v] / size;
+            h -= p * log2(p);
+        }
+    }
+    return h;
+}
+
+int comparedoubles(const void * a, const void * b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+double medianlatency(struct octave * o) {
+    double l[SCREENSAMPLES];
+    memcpy(l, o->latency, sizeof(l));
+    qsort(l, SCREENSAMPLES, sizeof(l[0]), comparedoubles);
+    return (l[SCREENSAMPLES / 2 - 1] + l[SCREENSAMPLES / 2]) / 2;
+}
+
+/* Returns 0 if nothing looks wrong, 1 if something is suspicious and 2 if
+ * the device looks fake. verbose prints the table even when all is well.
+ */
+int screen(unsigned long long totalsize, int verbose) {
+    struct octave octs[MAXOCTAVES];
+    int n = 0;
+    for (off_t start = SCREENSTART; (start < totalsize) && (n < MAXOCTAVES);
+         start *= 2, ++n) {
+        memset(octs + n, 0, sizeof(octs[n]));
+        octs[n].start = start;
+        octs[n].end = (2 * start < totalsize) ? 2 * start : totalsize;
+    }
+    if (n < 2) {
+        return 0;
+    }
+    unsigned char * bufs = iobuffer(2 * n * blocksize);
+    struct ioreq * reqs = malloc(2 * n * sizeof(*reqs));
+    if (reqs == NULL) {
+        printf("Out of memory\n");
+        exit(-1);
+    }
+    double start = now();
+    /* Round j reads sample j of every octave and its alias at once, so the
+     * latencies we compare were measured under the same load. The octaves
+     * go in the opposite order each round so that none always goes first.
+     */
+    for (int j = 0; j < SCREENSAMPLES; ++j) {
+        for (int kk = 0; kk < n; ++kk) {
+            int k = (j & 1) ? n - 1 - kk : kk;
+            off_t len = octs[k].end - octs[k].start;
+            off_t address = octs[k].start
+                            + (off_t)((2 * j + 1) * (len / (2 * SCREENSAMPLES)))
+                              / blocksize * blocksize;
+            ioprepare(reqs + 2 * k, &disk, IOREAD, address,
+                      bufs + 2 * k * blocksize, blocksize);
+            ioprepare(reqs + 2 * k + 1, &disk, IOREAD, address - octs[k].start,
+                      bufs + (2 * k + 1) * blocksize, blocksize);
+        }
+        if (iobatch(reqs, 2 * n) != 0) {
+            // reqs and bufs may still belong to the kernel, so we keep them
+            printf("%s stopped responding to reads, it may be a fake\n", filename);
+            return 2;
+        }
+        for (int k = 0; k < n; ++k) {
+            struct octave * o = octs + k;
+            struct ioreq * r = reqs + 2 * k;
+            unsigned char * b = bufs + 2 * k * blocksize;
+            o->latency[j] = r->completed - r->submitted;
+            if (r->result != blocksize) {
+                ++o->errors;
+                continue;
+            }
+            size_t i;
+            for (i = 1; (i < blocksize) && (b[i] == b[0]); ++i) {}
+            if (i == blocksize) {
+                ++o->constant;
+            } else if ((r[1].result == blocksize)
+                       && (memcmp(b, b + blocksize, blocksize) == 0)) {
+                ++o->aliased;
+            }
+            o->entropy += entropy(b, blocksize) / SCREENSAMPLES;
+        }
+    }
+    free(bufs);
+    free(reqs);
+    // the low half of the octaves is our idea of normal
+    int low = n / 2;
+    double lowlatency = 0;
+    int lowerrors = 0;
+    int lowconstant = 0;
+    for (int k = 0; k < low; ++k) {
+        lowlatency += medianlatency(octs + k) / low;
+        lowerrors += octs[k].errors;
+        lowconstant += octs[k].constant;
+    }
+    int verdict = 0;
+    char * notes[MAXOCTAVES];
+    for (int k = 0; k < n; ++k) {
+        struct octave * o = octs + k;
+        notes[k] = "";
+        if (k < low) {
+            continue;
+        }
+        if ((o->aliased >= 2) || ((o->errors > 0) && (lowerrors == 0))) {
+            notes[k] = (o->aliased >= 2) ? "  same data as the alias: FAKE"
+                                         : "  read errors: FAKE?";
+            verdict = 2;
+        } else if ((medianlatency(o) * SCREENFAST < lowlatency)
+                   && (o->constant == SCREENSAMPLES)
+                   && (lowconstant < low * SCREENSAMPLES)) {
+            notes[k] = "  fast constant data: suspicious";
+            verdict = (verdict > 1) ? verdict : 1;
+        }
+    }
+    if (verbose || (verdict > 0)) {
+        printf("Octave start     median latency  constant  aliased  errors  entropy\n");
+        for (int k = 0; k < n; ++k) {
+            struct octave * o = octs + k;
+            printf("%15ld %13.3f ms %6d/%d %8d %7d %8.2f%s\n", o->start,
+                   medianlatency(o) * 1000, o->constant, SCREENSAMPLES,
+                   o->aliased, o->errors, o->entropy, notes[k]);
+        }
+    }
+    printf("Read-only screen of %s took %.3f seconds: %s\n", filename,
+           now() - start, (verdict == 2) ? "it looks like a FAKE"
+                          : (verdict == 1) ? "some of it looks suspicious"
+                                           : "nothing suspicious");
+    return verdict;
+}
+
+/* A probe writes a pattern to one block and checks that it reads back, and
+ * that it hasn't turned up at the block we'd hit if the device ignored the
+ * top bit of the address. Done one probe at a time, a rotating disk's heads
+ * go back and forth between the two blocks and wait a revolution for each
+ * of the other four I/Os. Instead we take a batch of probes and sweep the
+ * heads across all their blocks, alternating direction:
+ * 1. up: read and save each block, then write its probe's pattern
+ * 2. down: read every block again to check it holds what it should
+ * 3. down: put back the saved data
+ * The restore has to go in the opposite order to the save: if a block
+ * aliases a lower one, what we saved from it is the lower block's pattern,
+ * and the lower block's own saved data must be written after it.
+ * Only one batch of blocks is ever holding test patterns, and a batch is a
+ * single probe unless the disk rotates, so we risk no more data than we
+ * must.
+ */
+#define PROBEBATCH 8 // probes whose blocks may hold test patterns at once
+#define MAXPROBES 256 // more than enough for 2^64 bytes
+#define SAMPLESTART (1024 * 1024) // where the size test starts, and the others
+#define SWEEPSAVE 0
+#define SWEEPCHECK 1
+#define SWEEPRESTORE 2
+
+unsigned long freeprobes; // probes which wrote in free space
+
+struct probeblock {
+    off_t address;
+    int pattern; // which probe's pattern we write here, -1 if just watching
+    int watcher; // which probe watches it for aliasing, if any
+    int free; // nothing to save or restore, we only write here
+    unsigned char * saved; // contents before we wrote anything
+    unsigned char * check; // contents after the patterns were written
+    int unsaved; // couldn't read it, so we mustn't write it
+    int unchecked; // couldn't read it back, check is meaningless
+};
+
+// Seek accounting for rotating disks
+struct seekstats {
+    off_t head; // where the last I/O ended
+    unsigned long seeks;
+    double seconds; // estimated time spent seeking
+};
+struct seekstats scheduled; // what we actually did
+struct seekstats unscheduled; // what probing one at a time would have done
+
+/* Rough seek model for a 7200 rpm disk: going back to the block we just
+ * did costs a revolution, anything else costs settle time plus a stroke
+ * time which grows as the square root of the distance, plus on average
+ * half a revolution.
+ */
+void seekaccount(struct seekstats * s, off_t address, size_t size,
+                 unsigned long long totalsize) {
+    if (address == s->head) {
+        return; // sequential, no seek
+    }
+    ++s->seeks;
+    if (address == s->head - size) {
+        s->seconds += 0.0083;
+    } else {
+        double distance = address > s->head ? address - s->head
+                                            : s->head - address;
+        s->seconds += 0.001 + 0.014 * sqrt(distance / totalsize) + 0.0042;
+    }
+    s->head = address + size;
+}
+
+void fillpattern(unsigned char * buf, int i) {
+    for (int n = 0; n < blocksize; ++n) {
+        buf[n] = (i + n) % 256;
+    }
+}
+
+// Which pattern, if any, a block holds
+int findpattern(unsigned char * buf, int first, int last) {
+    for (int i = first; i <= last; ++i) {
+        int n;
+        for (n = 0; (n < blocksize) && (buf[n] == (i + n) % 256); ++n) {}
+        if (n == blocksize) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int compareblocks(const void * a, const void * b) {
+    off_t x = ((const struct probeblock *)a)->address;
+    off_t y = ((const struct probeblock *)b)->address;
+    return (x > y) - (x < y);
+}
+
+/* Do one step of a batch for every block, sweeping up or down the disk.
+ * Returns the number of I/Os which failed.
+ */
+int probesweep(struct probeblock * blocks, int nb, int step,
+               unsigned long long totalsize) {
+    int failed = 0;
+    for (int k = 0; k < nb; ++k) {
+        struct probeblock * p = blocks + ((step == SWEEPSAVE) ? k : nb - 1 - k);
+        switch (step) {
+            case SWEEPSAVE:
+                if (!p->free) {
+                    seekaccount(&scheduled, p->address, blocksize, totalsize);
+                    p->unsaved = testio(IOREAD, p->address, p->saved) != 0;
+                    failed += p->unsaved;
+                }
+                if ((p->pattern >= 0) && !p->unsaved) {
+                    seekaccount(&scheduled, p->address, blocksize, totalsize);
+                    fillpattern(p->check, p->pattern);
+                    failed += testio(IOWRITE, p->address, p->check) != 0;
+                }
+                break;
+            case SWEEPCHECK:
+                if (!p->unsaved) {
+                    seekaccount(&scheduled, p->address, blocksize, totalsize);
+                    p->unchecked = testio(IOREAD, p->address, p->check) != 0;
+                    failed += p->unchecked;
+                }
+                break;
+            case SWEEPRESTORE:
+                if ((p->pattern >= 0) && !p->free && !p->unsaved) {
+                    seekaccount(&scheduled, p->address, blocksize, totalsize);
+                    failed += testio(IOWRITE, p->address, p->saved) != 0;
+                }
+                break;
+        }
+    }
+    return failed;
+}
+
+/* Test probes first to first + n - 1: probe i writes at one block below
+ * addresses[i] and watches that address modulo modulos[i]. Returns
+ * nonzero if anything failed; if bad isn't NULL, bad[i - first] is set
+ * for each probe which found a problem.
+ */
+int readbacktest(off_t * addresses, off_t * modulos, int first, int n,
+                 unsigned long long totalsize, int * bad) {
+    struct probeblock blocks[2 * PROBEBATCH];
+    int nb = 0;
+    for (int i = first; i < first + n; ++i) {
+        off_t address = (addresses[i] / blocksize - 1) * blocksize;
+        off_t old = ((address % modulos[i]) / blocksize) * blocksize;
+        // Probing one at a time would go old, address x 4, old
+        seekaccount(&unscheduled, old, blocksize, totalsize);
+        for (int k = 0; k < 4; ++k) {
+            seekaccount(&unscheduled, address, blocksize, totalsize);
+        }
+        seekaccount(&unscheduled, old, blocksize, totalsize);
+        off_t want[2] = { address, old };
+        for (int w = 0; w < 2; ++w) {
+            int b;
+            for (b = 0; (b < nb) && (blocks[b].address != want[w]); ++b) {}
+            if (b == nb) {
+                blocks[nb].address = want[w];
+                blocks[nb].pattern = -1;
+                blocks[nb].watcher = -1;
+                blocks[nb].free = 0;
+                blocks[nb].unsaved = 0;
+                blocks[nb].unchecked = 0;
+                if (posix_memalign((void **)&blocks[nb].saved,
+                                   disk.align, 2 * blocksize) != 0) {
+                    printf("Out of memory\n");
+                    exit(-1);
+                }
+                blocks[nb].check = blocks[nb].saved + blocksize;
+                ++nb;
+            }
+            if (w == 0) {
+                blocks[b].pattern = i;
+                blocks[b].free = isfree(address, blocksize);
+                freeprobes += blocks[b].free;
+            } else {
+                blocks[b].watcher = i;
+            }
+        }
+    }
+    qsort(blocks, nb, sizeof(blocks[0]), compareblocks);
+    int failed = probesweep(blocks, nb, SWEEPSAVE, totalsize);
+    failed += probesweep(blocks, nb, SWEEPCHECK, totalsize);
+    for (int b = 0; b < nb; ++b) {
+        struct probeblock * p = blocks + b;
+        unsigned char expect[MAXBLOCKSIZE];
+        int probe = (p->pattern >= 0) ? p->pattern : p->watcher;
+        if (p->unsaved || p->unchecked) {
+            if ((bad != NULL) && (probe >= 0)) {
+                bad[probe - first] = 1;
+            }
+            continue; // already in the bad region map
+        }
+        if (p->pattern >= 0) {
+            fillpattern(expect, p->pattern);
+        } else {
+            memcpy(expect, p->saved, blocksize);
+        }
+        if (memcmp(expect, p->check, blocksize) == 0) {
+            continue;
+        }
+        int culprit = findpattern(p->check, first, first + n - 1);
+        off_t from = 0;
+        for (int c = 0; c < nb; ++c) {
+            if (blocks[c].pattern == culprit) {
+                from = blocks[c].address;
+            }
+        }
+        int mismatch = 0;
+        for (int k = 0; k < blocksize; ++k) {
+            if (expect[k] == p->check[k]) { continue; }
+            ++mismatch;
+            if (mismatch >= 10) { continue; }
+            if ((culprit >= 0) && (culprit != p->pattern)) {
+                printf("Writing %hhX to address %ld corrupted address %ld from 0x%hhX to 0x%hhX\n",
+                       p->check[k], from + k, p->address + k,
+                       p->saved[k], p->check[k]);
+            } else if (p->free) {
+                printf("Wrote 0x%hhX at address %ld, read back 0x%hhX\n",
+                       expect[k], p->address + k, p->check[k]);
+            } else {
+                printf("Wrote 0x%hhX at address %ld, read back 0x%hhX, original data was 0x%hhX\n",
+                       expect[k], p->address + k, p->check[k], p->saved[k]);
+            }
+        }
+        if (mismatch >= 10) {
+            printf("...\n");
+        }
+        failed = 1;
+        if ((culprit >= 0) && (culprit != p->pattern)) {
+            probe = culprit;
+        }
+        if ((bad != NULL) && (probe >= 0)) {
+            bad[probe - first] = 1;
+        }
+        markbad(((culprit >= 0) && (culprit != p->pattern)) ? BADALIAS : BADDATA,
+                p->address, p->address + blocksize);
+        if ((p->pattern < 0) && overlaps(busy, nbusy, p->address, blocksize)) {
+            printf("Not restoring address %ld because it is in a busy partition\n",
+                   p->address);
+        } else if (p->pattern < 0) {
+            p->pattern = 0; // so that we try to write back its original data
+        }
+    }
+    // write back what we read before
+    failed += probesweep(blocks, nb, SWEEPRESTORE, totalsize);
+    for (int b = 0; b < nb; ++b) {
+        free(blocks[b].saved);
+    }
+    return failed;
+}
+
+/* A size test within a time budget. The probes go in van der Corput order,
+ * at 1/2, 1/4, 3/4, 1/8, 5/8, ... of the way through the device above
+ * SAMPLESTART, so that however many we have time for are spread evenly
+ * over it, and each one watches for aliasing modulo the largest power of
+ * two below its address. Each batch is sorted and moved into free space
+ * like the size test's probes. We stop when the next batch would overrun
+ * the budget and report how densely the device was covered.
+ */
+double vandercorput(uint64_t i) {
+    double f = 0;
+    for (double b = 0.5; i != 0; i >>= 1, b /= 2) {
+        if (i & 1) {
+            f += b;
+        }
+    }
+    return f;
+}
+
+int budgettest(double budget, int batch, unsigned long long totalsize) {
+    uint64_t nblocks = totalsize / blocksize;
+    uint64_t first = SAMPLESTART / blocksize;
+    off_t addresses[PROBEBATCH];
+    off_t modulos[PROBEBATCH];
+    struct extent * probed = NULL;
+    int nprobed = 0;
+    int done = 0;
+    double start = now();
+    double per = 0; // time for a batch
+    uint64_t i = 0;
+    if (nblocks <= first) {
+        printf("%s is too small for a budget test\n", filename);
+        return 0;
+    }
+    while (now() - start + per < budget) {
+        int n = 0;
+        for ( ; (n < batch) && (i < 2 * nblocks); ++i) {
+            off_t address = (first + (off_t)(vandercorput(i) * (nblocks - first)))
+                            * blocksize;
+            if (overlaps(busy, nbusy, address, blocksize)
+                || overlaps(probed, nprobed, address, blocksize)) {
+                continue;
+            }
+            off_t modulo = blocksize;
+            while (modulo * 2 <= address) {
+                modulo *= 2;
+            }
+            // keep the batch in address order, for placeprobes
+            int k;
+            for (k = 0; (k < n) && (addresses[k] != address + blocksize); ++k) {}
+            if (k < n) {
+                continue; // already in this batch
+            }
+            for (k = n; (k > 0) && (addresses[k - 1] > address + blocksize); --k) {
+                addresses[k] = addresses[k - 1];
+                modulos[k] = modulos[k - 1];
+            }
+            addresses[k] = address + blocksize;
+            modulos[k] = modulo;
+            ++n;
+        }
+        if (n == 0) {
+            break; // every block we may write has been tested
+        }
+        placeprobes(addresses, modulos, &n, totalsize);
+        for (int k = 0; k < n; ++k) {
+            addextent(&probed, &nprobed, addresses[k] - blocksize, addresses[k]);
+        }
+        claimpartitions(addresses, n);
+        int failed[PROBEBATCH] = { 0 };
+        int res = readbacktest(addresses, modulos, 0, n, totalsize, failed);
+        for (int k = 0; k < n; ++k) {
+            if (!failed[k] && (addresses[k] > proven)) {
+                proven = addresses[k];
+            }
+        }
+        if (res) {
+            exit(-1);
+        }
+        done += n;
+        per = (now() - start) / done * batch;
+    }
+    off_t gap = 0;
+    for (int k = 0; k <= nprobed; ++k) {
+        off_t from = (k > 0) ? probed[k - 1].end : 0;
+        off_t to = (k < nprobed) ? probed[k].start : totalsize;
+        if (to - from > gap) {
+            gap = to - from;
+        }
+    }
+    printf("Tested %d blocks spread over %s in %.1f seconds, one every %llu bytes%s\n",
+           done, filename, now() - start, totalsize / (done ? done : 1),
+           human(totalsize / (done ? done : 1)));
+    printf("The longest untested stretch is %ld bytes%s: fake or bad capacity any longer than that would have been found\n",
+           gap, human(gap));
+    if (done > 0) {
+        printf("Bad blocks scattered over more than %.3g%% of the device would have been found with 95%% confidence\n",
+               100 * (1 - pow(0.05, 1.0 / done)));
+    }
+    free(probed);
+    return done;
+}
+
+/* Sampling, for lots of identical media where testing every unit fully
+ * takes too long: probes at random blocks above the first Mibyte, each
+ * saved, written, checked and restored as in the size test, until the
+ * Wilson score interval for the fraction of bad blocks is entirely below
+ * or above the threshold we were given, or we run out of probes. A probe
+ * is bad if its block fails or its pattern turns up where it shouldn't.
+ * Looking at the interval after every probe and stopping the first time
+ * it's clear of the threshold would be wrong far more often than the
+ * confidence level says, so we only look when the number of probes
+ * reaches a power of two, and at the end, and share the error we allow
+ * between those looks.
+ */
+#define SAMPLECONFIDENCE 0.95
+#define SAMPLEMAXBAD 0.001 // default fraction of bad blocks we accept
+#define SAMPLEFIRSTLOOK 16 // probes before we first decide
+
+// Two sided normal quantile for a confidence level, by bisection
+double normalquantile(double confidence) {
+    double lo = 0;
+    double hi = 10;
+    for (int k = 0; k < 60; ++k) {
+        double z = (lo + hi) / 2;
+        if (erfc(z / sqrt(2)) > 1 - confidence) {
+            lo = z;
+        } else {
+            hi = z;
+        }
+    }
+    return (lo + hi) / 2;
+}
+
+void wilson(int bad, int n, double z, double * lo, double * hi) {
+    double p = (double)bad / n;
+    double d = 1 + z * z / n;
+    double centre = (p + z * z / (2 * n)) / d;
+    double half = z * sqrt(p * (1 - p) / n + z * z / (4.0 * n * n)) / d;
+    *lo = ((bad == 0) || (centre - half < 0)) ? 0 : centre - half;
+    *hi = (centre + half > 1) ? 1 : centre + half;
+}
+
+// splitmix64, so that the sample doesn't depend on RAND_MAX
+uint64_t samplerandom(uint64_t * state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/* Returns the number of probes done, and sets *verdict to -1 if the
+ * device should be rejected, 1 if accepted and 0 if we couldn't tell.
+ */
+int sampletest(int maxprobes, double confidence, double maxbad, int batch,
+               unsigned long long totalsize, int * verdict) {
+    uint64_t nblocks = totalsize / blocksize;
+    uint64_t first = SAMPLESTART / blocksize;
+    uint64_t state = (uint64_t)(now() * 1e9) ^ getpid();
+    off_t addresses[PROBEBATCH];
+    off_t modulos[PROBEBATCH];
+    int looks = 1;
+    for (long c = SAMPLEFIRSTLOOK; c < maxprobes; c *= 2) {
+        ++looks;
+    }
+    double z = normalquantile(1 - (1 - confidence) / looks);
+    long next = (SAMPLEFIRSTLOOK < maxprobes) ? SAMPLEFIRSTLOOK : maxprobes;
+    double lo = 0;
+    double hi = 1;
+    int done = 0;
+    int nbad = 0;
+    int tries = 0;
+    *verdict = 0;
+    if (nblocks <= first) {
+        printf("%s is too small to sample\n", filename);
+        return 0;
+    }
+    while ((done < maxprobes) && (*verdict == 0)) {
+        int n = 0;
+        for ( ; (n < batch) && (done + n < maxprobes) && (tries < 4 * maxprobes);
+              ++tries) {
+            off_t address = (first + samplerandom(&state) % (nblocks - first))
+                            * blocksize;
+            if (overlaps(busy, nbusy, address, blocksize)) {
+                continue;
+            }
+            off_t modulo = blocksize;
+            while (modulo * 2 <= address) {
+                modulo *= 2;
+            }
+            addresses[n] = address + blocksize;
+            modulos[n++] = modulo;
+        }
+        if (n == 0) {
+            printf("Could not find blocks outside busy partitions to sample\n");
+            break;
+        }
+        int bad[PROBEBATCH] = { 0 };
+        claimpartitions(addresses, n);
+        readbacktest(addresses, modulos, 0, n, totalsize, bad);
+        for (int i = 0; i < n; ++i) {
+            nbad += bad[i];
+        }
+        done += n;
+        if (done < next) {
+            continue;
+        }
+        next = (2 * next < maxprobes) ? 2 * next : maxprobes;
+        wilson(nbad, done, z, &lo, &hi);
+        if (hi < maxbad) {
+            *verdict = 1;
+        } else if (lo > maxbad) {
+            *verdict = -1;
+        }
+    }
+    if (done == 0) {
+        return 0;
+    }
+    wilson(nbad, done, z, &lo, &hi);
+    printf("%d of %d sampled blocks were bad: %.4g%% of %s, %g%% confidence interval %.4g%% to %.4g%%\n",
+           nbad, done, 100.0 * nbad / done, filename, 100 * confidence,
+           100 * lo, 100 * hi);
+    printf("%s %s %.4g%% bad blocks%s\n", filename,
+           (*verdict > 0) ? "has fewer than" : (*verdict < 0) ? "has more than"
+                                             : "may or may not have more than",
+           100 * maxbad,
+           (*verdict != 0) ? "" : ": give it more probes to tell");
+    return done;
+}
+
+/* The result of the last size test on a device, and what the device looked
+ * like then: its reported size, a CRC32 of its partition table and what
+ * the read-only screen made of it. If none of that has changed, and a few
+ * of the size test's probes still give the same answers, a re-run takes
+ * the old result instead of testing again.
+ */
+#define SIGNATUREPROBES 3 // highest probes we test again
+
+// Record the result of the size test, at exit because a failure exits
+void cacheremember() {
+    char value[32];
+    cacheput("test", cachetest);
+    cacheput("verdict", cacheverdict);
+    snprintf(value, sizeof(value), "%lld", (long long)proven);
+    cacheput("capacity", value);
+    snprintf(value, sizeof(value), "%llu", testedsize);
+    cacheput("size", value);
+    snprintf(value, sizeof(value), "0x%08X", layouthash);
+    cacheput("layout", value);
+    snprintf(value, sizeof(value), "%d", screened);
+    cacheput("screen", value);
+    snprintf(value, sizeof(value), "%lld", (long long)time(NULL));
+    cacheput("tested", value);
+    cachesave();
+}
+
+/* Whether the device still behaves as it did. Reading isn't enough: a
+ * device which wraps or drops writes reads everywhere. So we save, write,
+ * check and restore the highest few of the size test's probes, where a
+ * fake's capacity runs out, and for a device which failed the probe which
+ * ended at its capacity too. If it passed they must all pass; if it
+ * failed that one must pass and the highest must still fail.
+ */
+int signaturesok(off_t * addresses, off_t * modulos, int n, int failed,
+                 off_t capacity, unsigned long long totalsize) {
+    off_t a[MAXPROBES];
+    off_t m[MAXPROBES];
+    memcpy(a, addresses, n * sizeof(*a));
+    memcpy(m, modulos, n * sizeof(*m));
+    placeprobes(a, m, &n, totalsize); // as the test that we remember did
+    off_t sa[SIGNATUREPROBES + 1];
+    off_t sm[SIGNATUREPROBES + 1];
+    int k = 0;
+    int atcapacity = -1;
+    for (int i = 0; i < n; ++i) {
+        if ((i >= n - SIGNATUREPROBES) || (failed && (a[i] == capacity))) {
+            if (a[i] == capacity) {
+                atcapacity = k;
+            }
+            sa[k] = a[i];
+            sm[k++] = m[i];
+        }
+    }
+    if ((k == 0) || (failed && (capacity > 0) && (atcapacity < 0))) {
+        return 0;
+    }
+    claimpartitions(sa, k);
+    int bad[SIGNATUREPROBES + 1] = { 0 };
+    readbacktest(sa, sm, 0, k, totalsize, bad);
+    if (!failed) {
+        for (int i = 0; i < k; ++i) {
+            if (bad[i]) {
+                return 0;
+            }
+        }
+        return 1;
+    }
+    return bad[k - 1] && ((atcapacity < 0) || !bad[atcapacity]);
+}
+
+/* If the cache has the result of this test on this device and nothing we
+ * can see has changed, report it and exit with the status the test had.
+ * Checking costs a few probes, so this comes after the test is accepted.
+ */
+void cachedresult(char * test, off_t * addresses, off_t * modulos, int n,
+                  unsigned long long totalsize) {
+    char value[32];
+    char verdict[16];
+    if (!cacheget("test", value, sizeof(value)) || (strcmp(value, test) != 0)
+        || !cacheget("verdict", verdict, sizeof(verdict))) {
+        return;
+    }
+    char when[32] = "an unknown date";
+    if (cacheget("tested", value, sizeof(value))) {
+        time_t t = atoll(value);
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&t));
+    }
+    int failed = strcmp(verdict, "failed") == 0;
+    off_t capacity = cacheget("capacity", value, sizeof(value))
+                     ? strtoll(value, NULL, 10) : 0;
+    char * changed = NULL;
+    if (!cacheget("size", value, sizeof(value))
+        || (strtoull(value, NULL, 10) != totalsize)) {
+        changed = "its reported size has";
+    } else if (!cacheget("layout", value, sizeof(value))
+               || (strtoul(value, NULL, 16) != layouthash)) {
+        changed = "its partition table has";
+    } else if (!cacheget("screen", value, sizeof(value))
+               || (atoi(value) != screened)) {
+        changed = "what the read-only screen finds has";
+    } else if (!signaturesok(addresses, modulos, n, failed, capacity,
+                             totalsize)) {
+        changed = "the answers its highest probes give have";
+    }
+    if (changed != NULL) {
+        printf("%s had the %s test on %s, but %s changed since, so it needs testing again\n",
+               filename, test, when, changed);
+        return;
+    }
+    printf("%s had the %s test on %s with the result: %s\n",
+           filename, test, when, verdict);
+    if (failed) {
+        printf("The highest block which passed ended at %lld bytes%s\n",
+               (long long)capacity, human(capacity));
+    }
+    printf("Its size, partition table and screen haven't changed since and its highest\n");
+    printf("probes give the same answers, so we take that result: use --retest to test it again\n");
+    exit(failed ? -1 : (strcmp(verdict, "rejected") == 0) ? 1 : 0);
+}
+
+/* A surface scan covers the whole device, with the queue kept full of large
+ * extents. An extent which fails is split in half and the halves are done
+ * before the scan moves on, and so on down to single blocks, which go in
+ * the bad region map. Healthy areas go at full extent speed and each bad
+ * spot costs only a few small I/Os, where one EIO from a large read would
+ * otherwise hide which blocks are bad.
+ * The write scan first writes every block with its own address mixed with
+ * a random seed, then reads everything back, so blocks which hold another
+ * block's stamp show where the device aliases.
+ */
+#define SCANREAD 1
+#define SCANWRITE 2
+#define SCANREPORT 10.0 // seconds between progress reports
+
+uint64_t scanseed; // mixed into the stamps of a write scan
+unsigned long long scantotal; // size of the device being scanned
+
+struct scanstats {
+    unsigned long long bytes; // transferred successfully
+    unsigned long splits; // failed extents which we split
+};
+
+void stampblocks(unsigned char * buf, off_t address, size_t size) {
+    for (size_t b = 0; b < size; b += blocksize) {
+        uint64_t * w = (uint64_t *)(buf + b);
+        for (size_t k = 0; k < blocksize / sizeof(*w); ++k) {
+            w[k] = (address + b) ^ scanseed;
+        }
+    }
+}
+
+// Check blocks read back after a write scan
+void verifyblocks(unsigned char * buf, off_t address, size_t size) {
+    for (size_t b = 0; b < size; b += blocksize) {
+        uint64_t * w = (uint64_t *)(buf + b);
+        size_t k;
+        for (k = 1; (k < blocksize / sizeof(*w)) && (w[k] == w[0]); ++k) {}
+        if ((k == blocksize / sizeof(*w)) && ((w[0] ^ scanseed) == address + b)) {
+            continue;
+        }
+        uint64_t other = w[0] ^ scanseed;
+        int alias = (k == blocksize / sizeof(*w)) && (other < scantotal)
+                    && (other % blocksize == 0);
+        markbad(alias ? BADALIAS : BADDATA, address + b, address + b + blocksize);
+    }
+}
+
+/* Scan the given sorted ranges of the device in transfers of up to extent
+ * bytes, passing what a read pass reads successfully to consume. If the
+ * device stops responding, what was outstanding goes in the bad region map
+ * and the pass ends there.
+ */
+void scanpass(int op, struct extent * ranges, int nranges, size_t extent,
+              void (*consume)(unsigned char *, off_t, size_t),
+              struct scanstats * stats) {
+    int depth = disk.depth;
+    struct ioreq * reqs = malloc(depth * sizeof(*reqs));
+    unsigned char * bufs[MAXQUEUEDEPTH];
+    if (reqs == NULL) {
+        printf("Out of memory\n");
+        exit(-1);
+    }
+    int busy[MAXQUEUEDEPTH];
+    for (int s = 0; s < depth; ++s) {
+        bufs[s] = iobuffer(extent);
+        busy[s] = 0;
+        reqs[s].completed = 1; // so that iowaitsome() ignores free slots
+    }
+    struct extent * split = NULL; // stack of halves still to do
+    int nsplit = 0;
+    int ri = 0; // range we are in
+    off_t next = (nranges > 0) ? ranges[0].start : 0;
+    unsigned long long done = 0; // bytes of the ranges submitted
+    unsigned long long todo = 0;
+    for (int i = 0; i < nranges; ++i) {
+        todo += ranges[i].end - ranges[i].start;
+    }
+    int inflight = 0;
+    double report = now() + SCANREPORT;
+    for (;;) {
+        for (int s = 0; (s < depth) && ((nsplit > 0) || (ri < nranges))
+                        && !disk.failed; ++s) {
+            if (busy[s]) {
+                continue;
+            }
+            off_t address;
+            size_t size;
+            if (nsplit > 0) {
+                --nsplit;
+                address = split[nsplit].start;
+                size = split[nsplit].end - address;
+            } else {
+                address = next;
+                size = (ranges[ri].end - next < extent)
+                       ? ranges[ri].end - next : extent;
+                next += size;
+                done += size;
+                if ((next >= ranges[ri].end) && (++ri < nranges)) {
+                    next = ranges[ri].start;
+                }
+            }
+            if (op == IOWRITE) {
+                stampblocks(bufs[s], address, size);
+            }
+            ioprepare(reqs + s, &disk, op, address, bufs[s], size);
+            iosubmit(reqs + s);
+            busy[s] = 1;
+            ++inflight;
+        }
+        if (inflight == 0) {
+            break;
+        }
+        iowaitsome(reqs, depth, inflight - 1); // a hung device is disk.failed
+        for (int s = 0; s < depth; ++s) {
+            struct ioreq * r = reqs + s;
+            if (!busy[s] || (r->completed == 0)) {
+                continue;
+            }
+            busy[s] = 0;
+            --inflight;
+            off_t address = r->cb.aio_offset;
+            size_t size = r->cb.aio_nbytes;
+            if ((r->result == -ETIMEDOUT) && disk.failed) {
+                markbad((op == IOREAD) ? BADREAD : BADWRITE,
+                        address, address + size);
+                markbad(BADSLOW, address, address + size);
+            } else if (r->result != size) {
+                if (size > blocksize) {
+                    // the lower half goes on top so that it is done first
+                    size_t half = size / blocksize / 2 * blocksize;
+                    split = realloc(split, (nsplit + 2) * sizeof(*split));
+                    if (split == NULL) {
+                        printf("Out of memory\n");
+                        exit(-1);
+                    }
+                    split[nsplit].start = address + half;
+                    split[nsplit++].end = address + size;
+                    split[nsplit].start = address;
+                    split[nsplit++].end = address + half;
+                    ++stats->splits;
+                } else {
+                    markbad((op == IOREAD) ? BADREAD : BADWRITE,
+                            address, address + size);
+                }
+                continue;
+            }
+            stats->bytes += size;
+            if (r->completed - r->submitted > SLOWIO) {
+                markbad(BADSLOW, address, address + size);
+            }
+            if ((op == IOREAD) && (consume != NULL)) {
+                consume(bufs[s], address, size);
+            }
+        }
+        if (now() >= report) {
+            printf("%s %llu of %llu bytes%s\n", (op == IOREAD) ? "Read" : "Wrote",
+                   done, todo, human(todo));
+            fflush(stdout);
+            report = now() + SCANREPORT;
+        }
+    }
+    if (disk.failed) {
+        // reqs and bufs may still belong to the kernel, so we keep them
+        printf("The %s pass stopped after %llu of %llu bytes because %s stopped responding\n",
+               (op == IOREAD) ? "read" : "write", done, todo, filename);
+        free(split);
+        return;
+    }
+    for (int s = 0; s < depth; ++s) {
+        free(bufs[s]);
+    }
+    free(reqs);
+    free(split);
+}
+
+void surfacescan(int mode, struct extent * ranges, int nranges,
+                 unsigned long long totalsize) {
+    struct scanstats stats;
+    memset(&stats, 0, sizeof(stats));
+    double start = now();
+    scantotal = totalsize;
+    setreadahead(&disk, READAHEADSEQUENTIAL);
+    if (mode == SCANWRITE) {
+        scanseed = 0;
+        while (scanseed == 0) {
+            // never the same twice, so that stale stamps can't pass
+            scanseed = ((uint64_t)rand() << 32) ^ rand() ^ (uint64_t)(now() * 1e6);
+        }
+        scanpass(IOWRITE, ranges, nranges, disk.extent, NULL, &stats);
+        ssize_t res = singleio(IOSYNC, 0, NULL, 0, NULL);
+        if ((res < 0) && !disk.failed) {
+            printf("Error fsync'ing %s: %s\n", filename, strerror(-res));
+        }
+    }
+    if (!disk.failed) {
+        scanpass(IOREAD, ranges, nranges, disk.extent,
+                 (mode == SCANWRITE) ? verifyblocks : NULL, &stats);
+    }
+    if (disk.failed) {
+        return;
+    }
+    unsigned long long scanned = 0;
+    for (int i = 0; i < nranges; ++i) {
+        scanned += ranges[i].end - ranges[i].start;
+    }
+    double t = now() - start;
+    printf("Scanned %llu bytes%s in %.1f seconds, %.1f Mbytes/second, %lu failed extents split\n",
+           scanned, human(scanned), t, stats.bytes / t / 1e6, stats.splits);
+}
+
+/* Rescanning what an earlier run flagged: the regions in its bad region
+ * map, widened by a guard band on each side to catch damage which is
+ * spreading, are scanned again and compared with the old map.
+ */
+#define RESCANGUARD (1024 * 1024) // default guard band
+#define RESCANLIST 20 // regions we list of each outcome
+
+// Load a map saved with --badmap, which must be for this device
+void loadbadmap(char * name, unsigned long long totalsize,
+                struct extent ** old, int * nold) {
+    FILE * f = fopen(name, "r");
+    if (f == NULL) {
+        openerror(name);
+        exit(-1);
+    }
+    struct badmapheader h;
+    if ((fread(&h, sizeof(h), 1, f) != 1)
+        || (memcmp(h.magic, BADMAPMAGIC, sizeof(h.magic)) != 0)
+        || (h.version != 1)) {
+        printf("%s is not a bad region map\n", name);
+        exit(-1);
+    }
+    if ((h.devsize != totalsize) || (h.blocksize != blocksize)) {
+        printf("%s is for a device of %lu bytes with %u byte blocks, not %s\n",
+               name, h.devsize, h.blocksize, filename);
+        exit(-1);
+    }
+    for (uint64_t i = 0; i < h.count; ++i) {
+        struct badmaprecord r;
+        if (fread(&r, sizeof(r), 1, f) != 1) {
+            printf("%s is truncated\n", name);
+            exit(-1);
+        }
+        if ((r.kind >= NBADKINDS) || (r.end > totalsize)) {
+            printf("%s has a bad record %lu\n", name, i);
+            exit(-1);
+        }
+        addextent(&old[r.kind], &nold[r.kind], r.start, r.end);
+    }
+    fclose(f);
+}
+
+// Bytes of a list inside [start, end)
+off_t extentbytes(struct extent * list, int n, off_t start, off_t end) {
+    off_t bytes = 0;
+    for (int i = 0; i < n; ++i) {
+        off_t s = list[i].start > start ? list[i].start : start;
+        off_t e = list[i].end < end ? list[i].end : end;
+        if (e > s) {
+            bytes += e - s;
+        }
+    }
+    return bytes;
+}
+
+/* Compare each old region with what we found now: recovered (nothing
+ * there now), better (less of it), unchanged, worse (a slow region now
+ * fails) or spread (failures in the guard bands). Regions which a read
+ * scan can't check, wrong data and aliasing, are carried over as they were.
+ */
+void rescanreport(struct extent ** old, int * nold, off_t guard, int mode,
+                  unsigned long long totalsize) {
+    static char * outcomes[] = {
+        "recovered", "better", "unchanged", "worse", "spread", "not rechecked"
+    };
+    int counts[6] = { 0 };
+    for (int k = 0; k < NBADKINDS; ++k) {
+        for (int i = 0; i < nold[k]; ++i) {
+            struct extent * r = old[k] + i;
+            off_t lo = (r->start > guard) ? r->start - guard : 0;
+            off_t hi = (r->end + guard < totalsize) ? r->end + guard : totalsize;
+            off_t size = r->end - r->start;
+            int outcome;
+            if ((mode == SCANREAD) && ((k == BADDATA) || (k == BADALIAS))) {
+                markbad(k, r->start, r->end);
+                outcome = 5;
+            } else {
+                off_t inside = extentbytes(bad[k], nbad[k], r->start, r->end);
+                off_t around = extentbytes(bad[k], nbad[k], lo, hi);
+                off_t harder = 0;
+                for (int h = 0; h < k; ++h) {
+                    harder += extentbytes(bad[h], nbad[h], lo, hi);
+                }
+                if ((k == BADSLOW) && (harder > 0)) {
+                    outcome = 3;
+                } else if (around > inside) {
+                    outcome = 4;
+                } else if (inside == 0) {
+                    outcome = 0;
+                } else {
+                    outcome = (inside < size) ? 1 : 2;
+                }
+            }
+            if ((outcome != 2) && (counts[outcome] < RESCANLIST)) {
+                printf("Region from %ld to %ld with %s: %s\n", r->start,
+                       r->end, badkinds[k], outcomes[outcome]);
+            }
+            ++counts[outcome];
+        }
+    }
+    printf("Of the regions flagged before,");
+    for (int o = 0; o < 6; ++o) {
+        printf(" %d %s%s", counts[o], outcomes[o], (o < 5) ? "," : "\n");
+    }
+}
+
+/* Content digest: a Merkle tree over the whole device, saved to a file so
+ * that a later run can tell exactly which parts have changed, for checking
+ * drives for silent corruption between uses. Each leaf is the CRC32C of
+ * one transfer of the saving run, and each node above is the CRC32C of its
+ * DIGESTFANOUT children. The device is read with the surface scan engine,
+ * so the leaves are hashed as the reads complete, many at once. When
+ * verifying, equal roots mean nothing changed; otherwise we walk down only
+ * the subtrees which differ to find the leaves which changed.
+ */
+#define DIGESTMAGIC "DSDIGEST"
+#define DIGESTFANOUT 16
+#define DIGESTSAVE 1
+#define DIGESTVERIFY 2
+#define MAXDIGESTLEAF (64 * 1024 * 1024)
+#define MAXDIGESTBUFFERS (128 * 1024 * 1024) // leaves in flight at once
+
+struct digestheader {
+    char magic[8];
+    uint32_t version;
+    uint32_t leafsize;
+    uint64_t devsize;
+    uint64_t nodes; // uint32_t nodes following, leaves first, root last
+    uint32_t fanout;
+    uint32_t reserved;
+};
+
+size_t digestleaf; // bytes in each leaf
+uint64_t ndigestleaves;
+uint32_t * digesttree; // all levels, leaves first
+unsigned char * digestread; // leaves which were read completely
+
+void digestconsume(unsigned char * buf, off_t address, size_t size) {
+    uint64_t i = address / digestleaf;
+    size_t want = (scantotal - address < digestleaf) ? scantotal - address
+                                                     : digestleaf;
+    // a piece of a leaf means a split transfer, and an unreadable block
+    if ((address % digestleaf == 0) && (size == want)) {
+        digesttree[i] = crc32c(0, buf, size);
+        digestread[i] = 1;
+    }
+}
+
+// Total nodes in a tree with n leaves
+uint64_t digestnodes(uint64_t n) {
+    uint64_t total = n;
+    while (n > 1) {
+        n = (n + DIGESTFANOUT - 1) / DIGESTFANOUT;
+        total += n;
+    }
+    return total;
+}
+
+// Fill in the levels above the leaves
+void digestbuild(uint32_t * tree, uint64_t n) {
+    uint32_t * level = tree;
+    while (n > 1) {
+        uint64_t up = (n + DIGESTFANOUT - 1) / DIGESTFANOUT;
+        uint32_t * parent = level + n;
+        for (uint64_t i = 0; i < up; ++i) {
+            uint64_t first = i * DIGESTFANOUT;
+            uint64_t count = (n - first < DIGESTFANOUT) ? n - first
+                                                        : DIGESTFANOUT;
+            parent[i] = crc32c(0, (unsigned char *)(level + first),
+                               count * sizeof(*level));
+        }
+        level = parent;
+        n = up;
+    }
+}
+
+// Hash the whole device into digesttree, returns the leaves we couldn't read
+uint64_t digestdevice(unsigned long long totalsize) {
+    ndigestleaves = (totalsize + digestleaf - 1) / digestleaf;
+    digesttree = calloc(digestnodes(ndigestleaves), sizeof(*digesttree));
+    digestread = calloc(ndigestleaves, 1);
+    if ((digesttree == NULL) || (digestread == NULL)) {
+        printf("Out of memory\n");
+        exit(-1);
+    }
+    struct extent all = { 0, totalsize };
+    struct scanstats stats;
+    memset(&stats, 0, sizeof(stats));
+    scantotal = totalsize;
+    setreadahead(&disk, READAHEADSEQUENTIAL);
+    // the leaf size may come from a file, so it mustn't decide our memory use
+    int depth = disk.depth;
+    if (disk.depth * digestleaf > MAXDIGESTBUFFERS) {
+        disk.depth = (MAXDIGESTBUFFERS / digestleaf > 0)
+                     ? MAXDIGESTBUFFERS / digestleaf : 1;
+    }
+    double start = now();
+    scanpass(IOREAD, &all, 1, digestleaf, digestconsume, &stats);
+    double t = now() - start;
+    disk.depth = depth;
+    printf("Hashed %llu bytes%s in %.1f seconds, %.1f Mbytes/second\n",
+           totalsize, human(totalsize), t, stats.bytes / t / 1e6);
+    uint64_t unread = 0;
+    for (uint64_t i = 0; i < ndigestleaves; ++i) {
+        unread += !digestread[i];
+    }
+    if (unread > 0) {
+        printf("%lu of %lu leaves could not be read completely and have digest 0\n",
+               unread, ndigestleaves);
+    }
+    digestbuild(digesttree, ndigestleaves);
+    return unread;
+}
+
+/* Walk down from node i of the level starting at offset level (with n
+ * nodes), collecting the leaves under it which differ.
+ */
+void digestdiff(uint32_t * old, uint64_t * starts, uint64_t * counts,
+                int level, uint64_t i, struct extent ** changed, int * nchanged) {
+    if (old[starts[level] + i] == digesttree[starts[level] + i]) {
+        return;
+    }
+    if (level == 0) {
+        off_t end = (i + 1) * digestleaf;
+        addextent(changed, nchanged, i * digestleaf,
+                  (end < scantotal) ? end : scantotal);
+        return;
+    }
+    for (uint64_t c = i * DIGESTFANOUT;
+         (c < (i + 1) * DIGESTFANOUT) && (c < counts[level - 1]); ++c) {
+        digestdiff(old, starts, counts, level - 1, c, changed, nchanged);
+    }
+}
+
+void digest(int mode, char * name, unsigned long long totalsize) {
+    struct digestheader h;
+    if (mode == DIGESTSAVE) {
+        digestleaf = disk.extent;
+        if ((digestdevice(totalsize) > 0) || disk.failed) {
+            printf("%s could not all be read, so no digest was saved\n",
+                   filename);
+            exit(-1);
+        }
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, DIGESTMAGIC, sizeof(h.magic));
+        h.version = 1;
+        h.leafsize = digestleaf;
+        h.devsize = totalsize;
+        h.nodes = digestnodes(ndigestleaves);
+        h.fanout = DIGESTFANOUT;
+        FILE * f = fopen(name, "w");
+        if (f == NULL) {
+            openerror(name);
+            exit(-1);
+        }
+        if ((fwrite(&h, sizeof(h), 1, f) != 1)
+            || (fwrite(digesttree, sizeof(*digesttree), h.nodes, f) != h.nodes)
+            || (fclose(f) != 0)) {
+            printf("Error writing %s: %s\n", name, strerror(errno));
+            exit(-1);
+        }
+        printf("Saved the digest of %s in %s, root 0x%08X\n", filename, name,
+               digesttree[h.nodes - 1]);
+        return;
+    }
+    FILE * f = fopen(name, "r");
+    if (f == NULL) {
+        openerror(name);
+        exit(-1);
+    }
+    if ((fread(&h, sizeof(h), 1, f) != 1)
+        || (memcmp(h.magic, DIGESTMAGIC, sizeof(h.magic)) != 0)
+        || (h.version != 1) || (h.fanout != DIGESTFANOUT)
+        || (h.leafsize == 0) || (h.leafsize > MAXDIGESTLEAF)
+        || (h.leafsize % blocksize != 0)) {
+        printf("%s is not a digest this program can use\n", name);
+        exit(-1);
+    }
+    if (h.devsize != totalsize) {
+        printf("%s is the digest of a device of %lu bytes, %s has %llu\n",
+               name, h.devsize, filename, totalsize);
+        exit(-1);
+    }
+    digestleaf = h.leafsize;
+    uint64_t n = (totalsize + digestleaf - 1) / digestleaf;
+    uint32_t * old = malloc(digestnodes(n) * sizeof(*old));
+    if (old == NULL) {
+        printf("Out of memory\n");
+        exit(-1);
+    }
+    if ((h.nodes != digestnodes(n))
+        || (fread(old, sizeof(*old), h.nodes, f) != h.nodes)) {
+        printf("%s is truncated\n", name);
+        exit(-1);
+    }
+    fclose(f);
+    digestdevice(totalsize);
+    if (disk.failed) {
+        printf("%s stopped responding, so it could not be verified\n",
+               filename);
+        exit(-1);
+    }
+    if (old[h.nodes - 1] == digesttree[h.nodes - 1]) {
+        printf("%s is unchanged since %s was saved, root 0x%08X\n", filename,
+               name, old[h.nodes - 1]);
+        free(old);
+        return;
+    }
+    // where each level starts in the tree and how many nodes it has
+    uint64_t starts[64];
+    uint64_t counts[64];
+    int levels = 0;
+    starts[0] = 0;
+    counts[0] = n;
+    while (counts[levels] > 1) {
+        starts[levels + 1] = starts[levels] + counts[levels];
+        counts[levels + 1] = (counts[levels] + DIGESTFANOUT - 1) / DIGESTFANOUT;
+        ++levels;
+    }
+    struct extent * changed = NULL;
+    int nchanged = 0;
+    digestdiff(old, starts, counts, levels, 0, &changed, &nchanged);
+    off_t bytes = 0;
+    for (int i = 0; i < nchanged; ++i) {
+        printf("Changed: blocks %ld to %ld\n", changed[i].start / blocksize,
+               changed[i].end / blocksize - 1);
+        bytes += changed[i].end - changed[i].start;
+    }
+    printf("%s has changed since %s was saved: %ld bytes%s in %d regions\n",
+           filename, name, bytes, human(bytes), nchanged);
+    free(changed);
+    free(old);
+    exit(1);
+}
+
+// Start recording the trace, before the first I/O
+void traceopen(char * name, unsigned long long totalsize) {
+    tracefile = fopen(name, "w");
+    if (tracefile == NULL) {
+        openerror(name);
+        exit(-1);
+    }
+    struct traceheader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, TRACEMAGIC, sizeof(TRACEMAGIC));
+    h.version = 1;
+    h.blocksize = blocksize;
+    h.devsize = totalsize;
+    h.started = time(NULL);
+    if (fwrite(&h, sizeof(h), 1, tracefile) != 1) {
+        printf("Error writing %s: %s\n", name, strerror(errno));
+        exit(-1);
+    }
+    tracestart = now();
+}
+
+/* Replaying a trace issues its I/Os in the order they were submitted, each
+ * at the same time after the start as it was (or as soon as it can with
+ * --fast), with no more in flight than the recording had. Reads and syncs
+ * are harmless; writes put each block's address in it, as the write scan
+ * does, so a trace which writes needs the same confirmation. We report the
+ * I/Os whose result differs from the recording's, and compare latencies.
+ */
+#define MAXREPLAYING 256 // most I/Os we replay at once
+#define REPLAYLIST 10 // differences we list
+#define REPLAYPOLL 50e-6 // seconds we sleep waiting for the next I/O's time
+#define TRACESKIPPED 3 // op of a record we can't replay here
+#define MAXTRACEIO MAXDIGESTLEAF // the biggest I/O we ever do
+#define MAXREPLAYBUFFERS (256 * 1024 * 1024) // for the I/Os in flight
+
+int comparetrace(const void * a, const void * b) {
+    uint64_t x = ((const struct tracerecord *)a)->submitted;
+    uint64_t y = ((const struct tracerecord *)b)->submitted;
+    return (x > y) - (x < y);
+}
+
+int compareu64(const void * a, const void * b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// The most I/Os in flight at once in a trace sorted by submission
+int traceconcurrency(struct tracerecord * t, long n) {
+    uint64_t * ends = malloc((n + 1) * sizeof(*ends));
+    if (ends == NULL) {
+        printf("Out of memory\n");
+        exit(-1);
+    }
+    for (long i = 0; i < n; ++i) {
+        ends[i] = t[i].submitted + t[i].latency * 1000ULL;
+    }
+    qsort(ends, n, sizeof(*ends), compareu64);
+    int most = 0;
+    long e = 0;
+    for (long i = 0; i < n; ++i) {
+        while ((e < i) && (ends[e] <= t[i].submitted)) {
+            ++e;
+        }
+        if (i + 1 - e > most) {
+            most = i + 1 - e;
         }
     }
-    off_t n = lseek(fd, address, SEEK_SET);
-    if (n < 0) {
-        printf("seek to address %ld on %s failed: %s\n",
-            address, filename, strerror(errno));
+    free(ends);
+    return most;
+}
+
+void traceresult(int32_t result, char * buf, int size) {
+    if (result < 0) {
+        snprintf(buf, size, "%s", strerror(-result));
+    } else {
+        snprintf(buf, size, "%d bytes", result);
+    }
+}
+
+// Returns the number of I/Os whose result differed from the recording
+long replay(char * name, int fast, unsigned long long totalsize) {
+    static const char * opnames[] = { "read", "write", "sync" };
+    FILE * f = fopen(name, "r");
+    if (f == NULL) {
+        openerror(name);
         exit(-1);
-    } else if (n != address) {
-        printf("Seek to %ld on %s went to %ld instead\n",
-                address, filename, n);
+    }
+    struct traceheader h;
+    if ((fread(&h, sizeof(h), 1, f) != 1)
+        || (memcmp(h.magic, TRACEMAGIC, sizeof(TRACEMAGIC)) != 0)
+        || (h.version != 1) || (h.blocksize < MINBLOCKSIZE)
+        || (h.blocksize > MAXBLOCKSIZE)
+        || ((h.blocksize & (h.blocksize - 1)) != 0)) {
+        printf("%s is not a disksize trace\n", name);
         exit(-1);
     }
-    ssize_t nn = read(fd, buf, size);
-    if (nn < 0) {
-        printf("Reading %d bytes at offset %lu from %s failed: %s\n",
-                size, address, filename, strerror(errno));
+    struct stat st;
+    if (fstat(fileno(f), &st) != 0) {
+        printf("Error getting status of %s: %s\n", name, strerror(errno));
         exit(-1);
-    } else if (nn != size) {
-        printf("Reading %d bytes at offset %lu from %s read %d bytes instead\n",
-                size, address, filename, nn);
+    }
+    long n = (st.st_size - (off_t)sizeof(h)) / (off_t)sizeof(struct tracerecord);
+    if (n <= 0) {
+        printf("%s holds no I/Os\n", name);
         exit(-1);
     }
-    if (fsync(fd) != 0) {
-        printf("Error fsync'ing %s: %s\n", filename, strerror(errno));
+    struct tracerecord * t = malloc((n + 1) * sizeof(*t));
+    if (t == NULL) {
+        printf("Out of memory\n");
         exit(-1);
     }
-    if (close(fd) != 0) {
-        printf("Error closing %s: %s\n", filename, strerror(errno));
+    if (fread(t, sizeof(*t), n, f) != n) {
+        printf("Error reading %s\n", name);
         exit(-1);
     }
+    fclose(f);
+    qsort(t, n, sizeof(*t), comparetrace);
+    char when[32];
+    time_t started = h.started;
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&started));
+    printf("%s holds %ld I/Os recorded on %s, on a device of %llu bytes%s with %u byte blocks\n",
+           name, n, when, (unsigned long long)h.devsize, human(h.devsize),
+           h.blocksize);
+    long writes = 0;
+    long beyond = 0;
+    size_t maxsize = MAXBLOCKSIZE;
+    double recorded = 0;
+    for (long i = 0; i < n; ++i) {
+        struct tracerecord * x = t + i;
+        if ((x->op > IOSYNC) || ((x->op != IOSYNC)
+                                 && ((x->size == 0) || (x->size > MAXTRACEIO)
+                                     || (x->size % h.blocksize != 0)))) {
+            printf("%s is damaged: I/O %ld has op %u and size %u\n",
+                   name, i, x->op, x->size);
+            exit(-1);
+        }
+        if ((x->op != IOSYNC) && ((x->size > totalsize)
+                                  || (x->address > totalsize - x->size))) {
+            x->op = TRACESKIPPED;
+            ++beyond;
+            continue;
+        }
+        writes += x->op == IOWRITE;
+        if (x->size > maxsize) {
+            maxsize = x->size;
+        }
+        if (x->submitted / 1e9 + x->latency / 1e6 > recorded) {
+            recorded = x->submitted / 1e9 + x->latency / 1e6;
+        }
+    }
+    if (writes > 0) {
+        if (nbusy > 0) {
+            printf("%s has partitions in use, so it can't replay a trace which writes\n",
+                   filename);
+            exit(-1);
+        }
+        printf("The trace writes to %s %ld times, destroying what is in those blocks\n",
+               filename, writes);
+        printf("Do you want to replay it (Y/N)?");
+        if (confirm() == 0) { exit(0); }
+        printf("Are you sure?");
+        if (confirm() == 0) { exit(0); }
+    }
+    int slots = traceconcurrency(t, n);
+    slots = (slots < 1) ? 1 : (slots > MAXREPLAYING) ? MAXREPLAYING : slots;
+    size_t unit = (disk.align > MAXBLOCKSIZE) ? disk.align : MAXBLOCKSIZE;
+    maxsize = (maxsize + unit - 1) / unit * unit;
+    if (slots * maxsize > MAXREPLAYBUFFERS) {
+        slots = (MAXREPLAYBUFFERS / maxsize > 0) ? MAXREPLAYBUFFERS / maxsize : 1;
+        printf("Replaying at most %d I/Os at once, to keep their buffers in %d Mibytes\n",
+               slots, MAXREPLAYBUFFERS / (1024 * 1024));
+    }
+    unsigned char * bufs = iobuffer(slots * maxsize);
+    struct ioreq reqs[MAXREPLAYING];
+    long which[MAXREPLAYING]; // the record each slot is doing, -1 if free
+    for (int s = 0; s < slots; ++s) {
+        reqs[s].dev = &disk;
+        reqs[s].completed = 1; // so that we don't wait for it
+        which[s] = -1;
+    }
+    long count[3] = { 0 };
+    double was[3] = { 0 };
+    double took[3] = { 0 };
+    long differ = 0;
+    long next = 0;
+    int active = 0;
+    double start = now();
+    while ((next < n) || (active > 0)) {
+        // start everything which is due
+        while ((next < n) && (active < slots)) {
+            struct tracerecord * x = t + next;
+            if (x->op == TRACESKIPPED) {
+                ++next;
+                continue;
+            }
+            if (!fast && (now() - start < x->submitted / 1e9)) {
+                break;
+            }
+            int s;
+            for (s = 0; which[s] >= 0; ++s) {}
+            unsigned char * buf = bufs + s * maxsize;
+            if (x->op == IOSYNC) {
+                ioprepare(reqs + s, &disk, IOSYNC, 0, NULL, 0);
+            } else {
+                if (x->op == IOWRITE) {
+                    stampblocks(buf, x->address, x->size);
+                }
+                ioprepare(reqs + s, &disk, x->op, x->address, buf, x->size);
+            }
+            iosubmit(reqs + s);
+            which[s] = next++;
+            ++active;
+        }
+        // wait only if we can't start anything else until something finishes
+        int blocked = (active > 0) && ((next >= n) || (active >= slots) || fast);
+        if (iowaitsome(reqs, slots, blocked ? active - 1 : active) != 0) {
+            exit(-1);
+        }
+        int finished = 0;
+        for (int s = 0; s < slots; ++s) {
+            if ((which[s] < 0) || (reqs[s].completed == 0)) {
+                continue;
+            }
+            struct tracerecord * x = t + which[s];
+            struct ioreq * r = reqs + s;
+            ++count[x->op];
+            was[x->op] += x->latency / 1e6;
+            took[x->op] += r->completed - r->submitted;
+            if (r->result != x->result) {
+                char then[64];
+                char result[64];
+                traceresult(x->result, then, sizeof(then));
+                traceresult(r->result, result, sizeof(result));
+                if (++differ <= REPLAYLIST) {
+                    printf("    %s of %u bytes at address %lu: %s in the trace, %s now\n",
+                           opnames[x->op], x->size, x->address, then, result);
+                }
+            }
+            which[s] = -1;
+            --active;
+            ++finished;
+        }
+        if (!blocked && (finished == 0)) {
+            struct timespec ts = { 0, REPLAYPOLL * 1e9 };
+            nanosleep(&ts, NULL);
+        }
+    }
+    free(bufs);
+    free(t);
+    printf("Replayed %ld I/Os on %s in %.3f seconds%s; they took %.3f seconds when recorded\n",
+           count[IOREAD] + count[IOWRITE] + count[IOSYNC], filename,
+           now() - start, fast ? " as fast as possible" : "", recorded);
+    for (int op = IOREAD; op <= IOSYNC; ++op) {
+        if (count[op] > 0) {
+            printf("    %ld %ss, mean latency %.3f ms recorded, %.3f ms replayed\n",
+                   count[op], opnames[op], 1000 * was[op] / count[op],
+                   1000 * took[op] / count[op]);
+        }
+    }
+    if (beyond > 0) {
+        printf("%ld I/Os beyond the end of %s were left out\n", beyond, filename);
+    }
+    if (differ > 0) {
+        printf("%ld I/Os had a different result from the recording\n", differ);
+    } else {
+        printf("Every I/O had the same result as in the recording\n");
+    }
+    return differ;
 }
 
-// seek then write with some error reporting
-void checkedwrite(off_t address, void * buf, size_t size) {
-    int fd = open(filename, O_LARGEFILE|O_RDWR);
-    if (fd < 0) {
-        switch (errno) {
-            case ENODEV:
-            case ENXIO:
-            case ENOMEDIUM:
-                printf("No device connected at %s\n", filename);
-                exit(-1);
-            case ENOENT:
-                printf("%s does not exist\n", filename);
-                exit(-1);
-            case EPERM:
-            case EACCES:
-                printf("You aren't allowed to open %s\n", filename);
-                exit(-1);
-            default:
-                printf("Error opening %s: %s\n", filename, strerror(errno));
+/* After a test we often want the device blank. Rewriting all of it takes as
+ * long as a full surface test, but most devices can discard or zero their
+ * blocks in seconds. We do it in chunks to time it, then read back a sample
+ * of blocks to see whether they really are zero, which they must be after a
+ * zeroout and should be after a discard if the device claims so.
+ */
+#define WIPECHUNK (1024ULL * 1024 * 1024) // biggest range in one ioctl
+#define WIPESAMPLES 64 // blocks read back afterwards
+
+struct wipemethod {
+    char * name;
+    unsigned long request;
+};
+const struct wipemethod wipemethods[] = {
+    { "discard", BLKDISCARD },
+    { "zeroout", BLKZEROOUT },
+    { "secdiscard", BLKSECDISCARD }
+};
+#define NWIPEMETHODS (sizeof(wipemethods) / sizeof(wipemethods[0]))
+
+void wipe(struct iodev * dev, const struct wipemethod * m,
+          unsigned long long totalsize) {
+    int zeroout = m->request == BLKZEROOUT;
+    if (!zeroout && (dev->topo.discardgranularity == 0)) {
+        printf("%s does not support discard, use --wipe zeroout instead\n",
+               dev->name);
+        return;
+    }
+    unsigned long long chunk = WIPECHUNK;
+    if (!zeroout && (dev->topo.discardmax > 0)
+        && (dev->topo.discardmax < chunk)) {
+        chunk = dev->topo.discardmax - dev->topo.discardmax % blocksize;
+    }
+    printf("Wiping %s with %s\n", dev->name, m->name);
+    double start = now();
+    for (unsigned long long done = 0; done < totalsize; ) {
+        uint64_t range[2];
+        range[0] = done;
+        range[1] = (totalsize - done < chunk) ? totalsize - done : chunk;
+        if (ioctl(dev->fd, m->request, range) != 0) {
+            printf("%s of %llu bytes at offset %llu on %s failed: %s\n",
+                   m->name, (unsigned long long)range[1], done, dev->name,
+                   strerror(errno));
+            return;
+        }
+        done += range[1];
+    }
+    double seconds = now() - start;
+    printf("%s of %llu bytes took %.2f seconds, %.1f Mibytes per second\n",
+           m->name, totalsize, seconds,
+           seconds > 0 ? totalsize / seconds / (1024 * 1024) : 0.0);
+    unsigned char buffer[MAXBLOCKSIZE] ALIGNED;
+    int zeros = 0;
+    int sample;
+    for (sample = 0; sample <= WIPESAMPLES; ++sample) {
+        off_t address = (totalsize / blocksize - 1) * sample / WIPESAMPLES
+                        * blocksize;
+        if (checkedread(address, buffer, blocksize) != 0) {
+            continue;
+        }
+        int n;
+        for (n = 0; (n < blocksize) && (buffer[n] == 0); ++n) {}
+        if (n == blocksize) {
+            ++zeros;
+        } else if (zeroout || dev->topo.discardzeroes) {
+            printf("Block at address %ld on %s is not zero after %s\n",
+                   address, dev->name, m->name);
+        }
+    }
+    printf("%d of %d sampled blocks on %s read back as zero\n",
+           zeros, sample, dev->name);
+}
+
+// Ask, then wipe the whole device once the test which came first has passed
+void offerwipe(const struct wipemethod * m, char * test,
+               unsigned long long totalsize) {
+    printf("The %s passed. Wiping will destroy ALL the data on %s\n",
+           test, filename);
+    printf("Do you want to wipe it with %s (Y/N)?", m->name);
+    if (confirm() == 0) { exit(0); }
+    printf("Are you sure?");
+    if (confirm() == 0) { exit(0); }
+    releasepartitions();
+    claimdevice("wiping");
+    wipe(&disk, m, totalsize);
+}
+
+/* A read-only inventory of many devices at once: we open them all, then
+ * read the first two blocks of every one in a single batch, then the GPT
+ * entry arrays and backup headers of all those with GPT in a second
+ * batch, so a host with hundreds of disks takes two round trips rather
+ * than hundreds. A device which hangs is marked failed and the rest carry
+ * on; its buffers are never freed because the kernel may still own them.
+ */
+struct inventory {
+    struct iodev dev; // first, so that a request's dev leads back here
+    char * error; // why we couldn't look at it, NULL if we could
+    unsigned long long size;
+    char model[64];
+    unsigned char * head; // the first two logical blocks
+    unsigned char * backuphead;
+    struct gpt gpt;
+    struct gpt backup;
+    char * scheme; // gpt, mbr or none
+    int partitions;
+};
+
+void jsonstring(char * name, char * value, char * after) {
+    printf("\"%s\": \"", name);
+    for ( ; *value != '\0'; ++value) {
+        if ((*value == '"') || (*value == '\\')) {
+            printf("\\%c", *value);
+        } else if ((unsigned char)*value < ' ') {
+            printf("\\u%04x", *value);
+        } else {
+            putchar(*value);
+        }
+    }
+    printf("\"%s", after);
+}
+
+// What's wrong with a device's GPT, or "ok"
+char * gptstatus(struct inventory * v) {
+    if (!v->gpt.headercrcok) { return "bad header CRC"; }
+    if (v->gpt.entries == NULL) { return "unreadable table"; }
+    if (!v->gpt.tablecrcok) { return "bad table CRC"; }
+    if (v->gpt.alternate != (v->size / v->gpt.lbsize - 1) * v->gpt.lbsize) {
+        return "backup misplaced";
+    }
+    if (v->backup.lbsize == 0) { return "backup missing"; }
+    if (!v->backup.headercrcok) { return "bad backup CRC"; }
+    if (v->backup.tablecrc != v->gpt.tablecrc) { return "stale backup"; }
+    return "ok";
+}
+
+void inventory(char ** names, int n, int json) {
+    char ** found = NULL;
+    if (n == 0) {
+        DIR * d = opendir("/sys/block");
+        struct dirent * e;
+        while ((d != NULL) && ((e = readdir(d)) != NULL)) {
+            char dir[PATH_MAX];
+            snprintf(dir, sizeof(dir), "/sys/block/%s", e->d_name);
+            if ((e->d_name[0] == '.') || (sysfsnumber(dir, "size", 0) == 0)) {
+                continue;
+            }
+            found = realloc(found, (n + 1) * sizeof(char *));
+            if ((found == NULL) || (asprintf(found + n, "/dev/%s", e->d_name) < 0)) {
+                printf("Out of memory\n");
                 exit(-1);
+            }
+            ++n;
         }
+        if (d != NULL) {
+            closedir(d);
+        }
+        names = found;
     }
-    off_t n = lseek(fd, address, SEEK_SET);
-    if (n < 0) {
-        printf("seek to address %ld on %s failed: %s\n",
-            address, filename, strerror(errno));
-        exit(-1);
-    } else if (n != address) {
-        printf("Seek to %ld on %s went to %ld instead\n",
-                address, filename, n);
+    double start = now();
+    struct inventory * v = calloc(n, sizeof(*v));
+    struct ioreq * reqs = calloc(2 * n, sizeof(*reqs));
+    if ((n > 0) && ((v == NULL) || (reqs == NULL))) {
+        printf("Out of memory\n");
         exit(-1);
     }
-    ssize_t nn = write(fd, buf, size);
-    if (nn < 0) {
-        printf("Writing %d bytes at offset %ld to %s failed: %s\n",
-                size, address, filename, strerror(errno));
-        exit(-1);
-    } else if (nn != size) {
-        printf("Writing %d bytes at offset %ld to %s wrote %d bytes instead\n",
-                size, address, filename, nn);
+    int nr = 0;
+    for (int i = 0; i < n; ++i) {
+        struct iodev * dev = &v[i].dev;
+        if (devopen(dev, names[i], O_RDONLY) < 0) {
+            v[i].error = strdup(strerror(errno));
+            continue;
+        }
+        if (ioctl(dev->fd, BLKGETSIZE64, &v[i].size) != 0) {
+            v[i].error = "not a block device";
+            continue;
+        }
+        probetopology(dev);
+        tuneio(dev);
+        sysfsstring(dev->topo.sysdir, "device/model", v[i].model,
+                    sizeof(v[i].model), "");
+        size_t lb = dev->topo.logical;
+        if (v[i].size < 2 * lb) {
+            continue;
+        }
+        v[i].head = iobuffer(2 * lb);
+        ioprepare(reqs + nr++, dev, IOREAD, 0, v[i].head, 2 * lb);
+    }
+    iobatch(reqs, nr);
+    for (int r = 0; r < nr; ++r) {
+        struct inventory * x = (struct inventory *)reqs[r].dev;
+        if (reqs[r].result != reqs[r].cb.aio_nbytes) {
+            x->error = reqs[r].result == -ETIMEDOUT ? "timed out" : "unreadable";
+        }
+    }
+    // Now the GPT entry arrays and backup headers
+    nr = 0;
+    for (int i = 0; i < n; ++i) {
+        struct inventory * x = v + i;
+        x->scheme = "none";
+        if ((x->error != NULL) || (x->head == NULL)) {
+            continue;
+        }
+        size_t lb = x->dev.topo.logical;
+        unsigned char * mbr = x->head;
+        if ((mbr[510] != 0x55) || (mbr[511] != 0xAA)) {
+            continue;
+        }
+        x->scheme = "mbr";
+        for (int k = 0; k < 4; ++k) {
+            unsigned char type = mbr[446 + 16 * k + 4];
+            if (type == 0xEE) {
+                x->scheme = "gpt";
+            }
+            x->partitions += type != 0;
+        }
+        if ((strcmp(x->scheme, "mbr") == 0)
+            && (mbrproblem(mbr, lb, x->size) != NULL)) {
+            x->scheme = "none"; // a filesystem, or damage
+            x->partitions = 0;
+            continue;
+        }
+        if ((strcmp(x->scheme, "gpt") != 0)
+            || (gptparse(x->head + lb, lb, lb, &x->gpt) != 0)) {
+            continue;
+        }
+        x->partitions = 0;
+        size_t tsize = gpttablesize(&x->gpt);
+        if ((tsize > 0) && (x->gpt.table + tsize <= x->size)) {
+            x->gpt.entries = iobuffer(tsize);
+            ioprepare(reqs + nr++, &x->dev, IOREAD, x->gpt.table,
+                      x->gpt.entries, tsize);
+        }
+        if (x->gpt.alternate + lb <= x->size) {
+            x->backuphead = iobuffer(lb);
+            ioprepare(reqs + nr++, &x->dev, IOREAD, x->gpt.alternate,
+                      x->backuphead, lb);
+        }
+    }
+    iobatch(reqs, nr);
+    for (int r = 0; r < nr; ++r) {
+        struct inventory * x = (struct inventory *)reqs[r].dev;
+        int ok = reqs[r].result == reqs[r].cb.aio_nbytes;
+        if (reqs[r].cb.aio_buf == x->backuphead) {
+            if (!ok || (gptparse(x->backuphead, x->gpt.lbsize,
+                                 x->gpt.alternate, &x->backup) != 0)) {
+                memset(&x->backup, 0, sizeof(x->backup));
+            }
+        } else if (!ok) {
+            x->gpt.entries = NULL; // may still be in use if we timed out
+        } else {
+            gptchecktable(&x->gpt);
+            for (uint32_t p = 0; p < x->gpt.pcount; ++p) {
+                unsigned char * entry = x->gpt.entries + (size_t)p * x->gpt.psize;
+                x->partitions += *(off_t *)(entry + 32) != *(off_t *)(entry + 40);
+            }
+        }
+        if (x->dev.failed) {
+            x->error = "timed out";
+        }
+    }
+    double seconds = now() - start;
+    if (json) {
+        printf("[\n");
+    } else {
+        printf("%-16s %16s %5s %5s %-7s %-4s %-6s %5s %-16s %s\n",
+               "DEVICE", "SIZE", "LBS", "PBS", "BUS", "ROT", "SCHEME",
+               "PARTS", "STATUS", "MODEL");
+    }
+    for (int i = 0; i < n; ++i) {
+        struct inventory * x = v + i;
+        struct topology * t = &x->dev.topo;
+        char * status = x->error ? x->error
+                        : strcmp(x->scheme, "gpt") ? "ok" : gptstatus(x);
+        if (json) {
+            printf("  {");
+            jsonstring("device", names[i], ", ");
+            printf("\"size\": %llu, \"logical\": %u, \"physical\": %u, ",
+                   x->size, t->logical, t->physical);
+            printf("\"io_min\": %u, \"io_opt\": %u, \"max_sectors_kb\": %u, ",
+                   t->iomin, t->ioopt, t->maxsectorskb);
+            printf("\"nr_requests\": %u, \"rotational\": %s, ",
+                   t->nrrequests, t->rotational ? "true" : "false");
+            printf("\"discard_granularity\": %llu, ", t->discardgranularity);
+            jsonstring("zoned", t->zoned, ", ");
+            jsonstring("transport", t->transport, ", ");
+            jsonstring("model", x->model, ", ");
+            jsonstring("scheme", x->scheme, ", ");
+            printf("\"partitions\": %d, ", x->partitions);
+            jsonstring("status", status, "}");
+            printf("%s\n", i + 1 < n ? "," : "");
+        } else {
+            printf("%-16s %16llu %5u %5u %-7s %-4s %-6s %5d %-16s %s\n",
+                   names[i], x->size, t->logical, t->physical, t->transport,
+                   t->rotational ? "yes" : "no", x->scheme, x->partitions,
+                   status, x->model);
+        }
+    }
+    if (json) {
+        printf("]\n");
+    } else {
+        printf("Inventory of %d devices took %.3f seconds\n", n, seconds);
+    }
+}
+
+/* Microbenchmarks of the primitives the tests are built from, so that a
+ * change meant to make disksize faster can be measured instead of guessed
+ * at. Each benchmark repeats one operation enough times to take about
+ * MBREPTIME seconds; after a warm-up we time MBREPS such repetitions and
+ * report the median, 90th and 99th percentile times per operation.
+ * --save writes them to a file, and --baseline compares a run with a file
+ * saved earlier and flags anything more than MBREGRESSION slower.
+ * The reads go to blocks spread over the first MBSPAN bytes of the device,
+ * through checkedread and, for comparison, through pread on the buffered
+ * and O_DIRECT descriptors and through io_uring. The write rewrites one
+ * block with what it already holds.
+ */
+#define MBREPS 31
+#define MBREPTIME 0.01 // seconds
+#define MBMAXOPS (1L << 24) // most operations in a repetition
+#define MBSPAN (64 * 1024 * 1024)
+#define MBREGRESSION 0.10
+#define MBCRCSIZE (16 * 1024) // a default GPT entry array
+#define MBWRITEFLOOR (1024 * 1024) // lowest block checkedwrite may rewrite
+
+struct microbench {
+    char * name;
+    void (*op)(long i);
+    char * skip; // why not, if we can't run it here
+    long ops; // per repetition
+    double ns[MBREPS]; // per operation, sorted
+    double baseline; // median from --baseline, 0 if none
+};
+
+unsigned char * mbbuf;
+unsigned char * mbblock; // contents of the block we rewrite
+unsigned char * mbpattern; // the last pattern findpattern looks for
+unsigned char * mbcopy; // the same again, for compare
+unsigned char mbgpt[MAXBLOCKSIZE];
+off_t mbspan;
+off_t mbwriteaddress;
+volatile unsigned long mbsink; // keeps the compiler from dropping results
+
+/* A ring of our own to issue one read and wait for it, so that we time
+ * io_uring itself rather than the engine's bookkeeping.
+ */
+struct uring mburing;
+
+// Read and wait for it, returns bytes read or -errno
+ssize_t uringread(struct uring * u, int fd, void * buf, size_t size,
+                  off_t address) {
+    uringpush(u, IORING_OP_READ, fd, buf, size, address, 0);
+    if (syscall(__NR_io_uring_enter, u->fd, 1, 1, IORING_ENTER_GETEVENTS,
+                NULL, 0) < 0) {
+        return -errno;
+    }
+    unsigned head = *u->cqhead;
+    while (head == __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE)) {}
+    ssize_t res = u->cqes[head & *u->cqmask].res;
+    __atomic_store_n(u->cqhead, head + 1, __ATOMIC_RELEASE);
+    return res;
+}
+
+// The i'th block we read, striding about so that neighbours aren't cached
+off_t mbaddress(long i) {
+    return (off_t)(((uint64_t)i * 7919) % (mbspan / blocksize)) * blocksize;
+}
+
+void mbcheck(char * what, ssize_t res, long i) {
+    if (res != blocksize) {
+        printf("%s of %lu bytes at offset %ld from %s failed: %s\n", what,
+               blocksize, mbaddress(i), filename,
+               res < 0 ? strerror(errno) : "short read");
         exit(-1);
     }
-    if (fsync(fd) != 0) {
-        printf("Error fsync'ing %s: %s\n", filename, strerror(errno));
+}
+
+void mbcheckedread(long i) {
+    if (checkedread(mbaddress(i), mbbuf, blocksize) != 0) {
         exit(-1);
     }
-    if (close(fd) != 0) {
-        printf("Error closing %s: %s\n", filename, strerror(errno));
+}
+
+void mbcheckedwrite(long i) {
+    if (checkedwrite(mbwriteaddress, mbblock, blocksize) != 0) {
         exit(-1);
     }
 }
 
-void partitions(off_t base, int pcount, int psize) {
-    printf("    %d partitions of size %d at %ld to %ld:\n",
-           pcount, psize, base, base + pcount * (long)psize);
-    printf("    (empty partitions omitted)\n");
-    unsigned char buffer [MAXBLOCKSIZE];
-    off_t currentblock = base;
-    checkedread(currentblock, buffer, blocksize);
-    off_t paddr = 0;
-    for (int p = 0; p < pcount; ++p) {
-        if (paddr >= blocksize) {
-            currentblock += blocksize;
-            paddr -= blocksize;
-            checkedread(currentblock, buffer, blocksize);
-        }
-        off_t start = *(off_t *)(buffer + paddr + 32) * blocksize;
-        off_t end = *(off_t *)(buffer + paddr + 40) * blocksize;
-        if (start != end) {
-            printf("        from %ld to %ld\n", start, end);
-        }
-        paddr += psize;
+void mbpread(long i) {
+    // as iosubmit does, so that we time the device and not the page cache
+    off_t page = sysconf(_SC_PAGESIZE);
+    posix_fadvise(disk.fd, mbaddress(i) & ~(page - 1), page,
+                  POSIX_FADV_DONTNEED);
+    mbcheck("pread", pread(disk.fd, mbbuf, blocksize, mbaddress(i)), i);
+}
+
+void mbpreaddirect(long i) {
+    mbcheck("O_DIRECT pread",
+            pread(disk.direct[0], mbbuf, blocksize, mbaddress(i)), i);
+}
+
+void mburingread(long i) {
+    ssize_t res = uringread(&mburing, disk.direct[0], mbbuf, blocksize,
+                            mbaddress(i));
+    if (res < 0) {
+        errno = -res;
     }
+    mbcheck("io_uring read", res, i);
 }
 
-void readbacktest(off_t address, off_t modulo, int i) {
-    unsigned char prevdata[MAXBLOCKSIZE];
-    unsigned char originalreaddata[MAXBLOCKSIZE];
-    unsigned char writedata[MAXBLOCKSIZE];
-    unsigned char readbackdata[MAXBLOCKSIZE];
-    address -= blocksize; // go back one block
-    off_t old = address % modulo;
-    checkedread(old, prevdata, blocksize);
-    checkedread(address, originalreaddata, blocksize);
-    int n;
-    for (n = 0; n < blocksize; ++n) {
-        writedata[n] = (i + n) % 256;
-    }
-    checkedwrite(address, writedata, blocksize);
-    // read back the data
-    checkedread(address, readbackdata, blocksize);
-    // see if it is what we wrote
-    int mismatch = 0;
-    int corruption = 0;
-    for (n = 0; n < MAXBLOCKSIZE; ++n) {
-        if (readbackdata [n] != writedata[n]) {
-            ++mismatch;
-            if (mismatch < 10) {
-                printf("Wrote 0x%hhX at address %ld, read back 0x%hhX, original data was 0x%hhX\n",
-                    writedata[n], address + n, readbackdata[n], originalreaddata[n]);
-            } else if (mismatch == 10) {
-                printf("...\n");
-            }
+void mbfillpattern(long i) {
+    fillpattern(mbbuf, i);
+    mbsink += mbbuf[i % blocksize];
+}
+
+// Blocks which match, so memcmp has to look at all of them
+void mbcompare(long i) {
+    mbsink += memcmp(mbpattern, mbcopy, blocksize) == 0;
+}
+
+// The worst case: the block holds the last pattern we look for
+void mbfindpattern(long i) {
+    mbsink += findpattern(mbpattern, 0, PROBEBATCH - 1);
+}
+
+void mbgptparse(long i) {
+    struct gpt g;
+    gptparse(mbgpt, MINBLOCKSIZE, MINBLOCKSIZE, &g);
+    mbsink += g.headercrcok;
+}
+
+void mbcrc32(long i) {
+    mbsink += crc32(0, mbbuf, MBCRCSIZE);
+}
+
+void mbcrc32c(long i) {
+    mbsink += crc32c(0, mbbuf, MBCRCSIZE);
+}
+
+void mbhuman(long i) {
+    mbsink += strlen(human(10000ULL << (i % 50)));
+}
+
+struct microbench microbenches[] = {
+    { "checkedread", mbcheckedread },
+    { "checkedwrite", mbcheckedwrite },
+    { "pread", mbpread },
+    { "pread-direct", mbpreaddirect },
+    { "io_uring-read", mburingread },
+    { "fillpattern", mbfillpattern },
+    { "compare", mbcompare },
+    { "findpattern", mbfindpattern },
+    { "gptparse", mbgptparse },
+    { "crc32-16k", mbcrc32 },
+    { "crc32c-16k", mbcrc32c },
+    { "human", mbhuman }
+};
+#define NMICROBENCHES (sizeof(microbenches) / sizeof(microbenches[0]))
+
+struct microbench * findmicrobench(char * name) {
+    for (int b = 0; b < NMICROBENCHES; ++b) {
+        if (strcmp(microbenches[b].name, name) == 0) {
+            return microbenches + b;
         }
     }
-    // write back what we read before
-    checkedwrite(address, originalreaddata, blocksize);
-    // not the first time, check if we corrupted offset/2-size
-    checkedread(old, readbackdata, blocksize);
-    for (n = 0; n < blocksize; ++n) {
-        if (readbackdata [n] != prevdata[n]) {
-            ++corruption;
-            if (corruption < 10) {
-                printf("Writing %hhX to address %ld corrupted address %ld from 0x%hhX to 0x%hhX\n",
-                        writedata[n], address + n, old + n, prevdata[n], readbackdata [n]);
-            } else if (corruption == 10) {
-                printf("...\n");
+    return NULL;
+}
+
+// Seconds to do n operations
+double mbtime(struct microbench * m, long n) {
+    double start = now();
+    for (long i = 0; i < n; ++i) {
+        m->op(i);
+    }
+    return now() - start;
+}
+
+/* A valid GPT header for gptparse, as a 64 Mibyte disk with 512 byte
+ * blocks would have.
+ */
+void mbmakegpt() {
+    memset(mbgpt, 0, sizeof(mbgpt));
+    *(unsigned long long *)mbgpt = GPTSIGNATURE;
+    *(uint32_t *)(mbgpt + 8) = 0x00010000; // revision 1.0
+    *(uint32_t *)(mbgpt + 12) = 92;
+    *(uint64_t *)(mbgpt + 24) = 1;
+    *(uint64_t *)(mbgpt + 32) = 131071;
+    *(uint64_t *)(mbgpt + 40) = 34;
+    *(uint64_t *)(mbgpt + 48) = 131038;
+    *(uint64_t *)(mbgpt + 72) = 2;
+    *(uint32_t *)(mbgpt + 80) = 128;
+    *(uint32_t *)(mbgpt + 84) = 128;
+    *(uint32_t *)(mbgpt + 16) = crc32(0, mbgpt, 92);
+}
+
+/* Where we may rewrite a block, or -1 if nowhere: in a gap in the layout
+ * if we know it, and like the size test never below the first Mibyte,
+ * where the partition table and boot loader live.
+ */
+off_t mbwritable() {
+    off_t address = layoutknown ? nearestgap(used, nused, MBWRITEFLOOR,
+                                             MBWRITEFLOOR, mbspan)
+                                : MBWRITEFLOOR;
+    if ((address < 0) || (address + blocksize > mbspan)
+        || overlaps(busy, nbusy, address, blocksize)) {
+        return -1;
+    }
+    if (disk.backend != BACKENDDEVICE) {
+        return address;
+    }
+    if (!isatty(fileno(stdin))) {
+        return -1;
+    }
+    printf("The checkedwrite benchmark rewrites the block at address %ld of %s\n",
+           address, filename);
+    printf("with its own contents, thousands of times. Run it? (Y/N) ");
+    fflush(stdout);
+    return confirm() ? address : -1;
+}
+
+// Read a file written by --save, to compare this run with it
+void mbloadbaseline(char * name) {
+    FILE * f = fopen(name, "r");
+    if (f == NULL) {
+        printf("Can't open %s: %s\n", name, strerror(errno));
+        exit(-1);
+    }
+    char line[256];
+    char benchname[64];
+    double median;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if ((line[0] != '#')
+            && (sscanf(line, "%63s %lf", benchname, &median) == 2)) {
+            struct microbench * m = findmicrobench(benchname);
+            if (m != NULL) {
+                m->baseline = median;
             }
         }
     }
-    if (corruption) {
-        // try to write back the original data
-        checkedwrite(address, prevdata, blocksize);
+    fclose(f);
+}
+
+// Nearest rank percentile of a benchmark's times
+double mbpercentile(struct microbench * m, double p) {
+    int k = (int)ceil(p / 100 * MBREPS) - 1;
+    return m->ns[k < 0 ? 0 : k];
+}
+
+/* Run the benchmarks and print the table. Returns 1 if any is slower than
+ * its baseline, otherwise 0.
+ */
+int microbench(unsigned long long totalsize, char * savefile,
+               char * baselinefile) {
+    double start = now();
+    mbspan = (totalsize < MBSPAN) ? totalsize / blocksize * blocksize : MBSPAN;
+    mbbuf = iobuffer(MBCRCSIZE);
+    mbblock = iobuffer(blocksize);
+    mbpattern = iobuffer(blocksize);
+    mbcopy = iobuffer(blocksize);
+    fillpattern(mbpattern, PROBEBATCH - 1);
+    memcpy(mbcopy, mbpattern, blocksize);
+    mbmakegpt();
+    if (baselinefile != NULL) {
+        mbloadbaseline(baselinefile);
     }
-    if (mismatch || corruption) {
+    mbwriteaddress = mbwritable();
+    if ((mbwriteaddress >= 0)
+        && (checkedread(mbwriteaddress, mbblock, blocksize) != 0)) {
         exit(-1);
+    } else if (mbwriteaddress < 0) {
+        findmicrobench("checkedwrite")->skip = "no block we may write";
+    }
+    if (disk.backend == BACKENDSIM) {
+        findmicrobench("pread")->skip = "the simulator has no file";
+    }
+    if (disk.ndirect == 0) {
+        findmicrobench("pread-direct")->skip = "no O_DIRECT";
+        findmicrobench("io_uring-read")->skip = "no O_DIRECT";
+    } else if (uringsetup(&mburing, 1) != 0) {
+        findmicrobench("io_uring-read")->skip = strerror(errno);
+    }
+    printf("Microbenchmarks of %s, %d repetitions, times in ns per operation\n",
+           filename, MBREPS);
+    printf("Benchmark            ops/rep      median         p90         p99  baseline\n");
+    int slower = 0;
+    for (int b = 0; b < NMICROBENCHES; ++b) {
+        struct microbench * m = microbenches + b;
+        if (m->skip != NULL) {
+            printf("%-16s  skipped: %s\n", m->name, m->skip);
+            continue;
+        }
+        // warm up, finding how many operations take MBREPTIME
+        for (m->ops = 1; (mbtime(m, m->ops) < MBREPTIME) && (m->ops < MBMAXOPS);
+             m->ops *= 2) {}
+        for (int r = 0; r < MBREPS; ++r) {
+            m->ns[r] = mbtime(m, m->ops) * 1e9 / m->ops;
+        }
+        qsort(m->ns, MBREPS, sizeof(m->ns[0]), comparedoubles);
+        double median = mbpercentile(m, 50);
+        printf("%-16s %11ld %11.1f %11.1f %11.1f", m->name, m->ops, median,
+               mbpercentile(m, 90), mbpercentile(m, 99));
+        if (m->baseline > 0) {
+            double change = median / m->baseline - 1;
+            printf("  %+.1f%%%s", change * 100,
+                   (change > MBREGRESSION) ? " SLOWER" : "");
+            slower |= change > MBREGRESSION;
+        }
+        printf("\n");
+    }
+    if (savefile != NULL) {
+        FILE * f = fopen(savefile, "w");
+        if (f == NULL) {
+            printf("Can't create %s: %s\n", savefile, strerror(errno));
+            exit(-1);
+        }
+        fprintf(f, "# disksize microbenchmarks of %s: median, p90 and p99 ns per operation\n",
+                filename);
+        for (int b = 0; b < NMICROBENCHES; ++b) {
+            struct microbench * m = microbenches + b;
+            if (m->skip == NULL) {
+                fprintf(f, "%s %.1f %.1f %.1f\n", m->name, mbpercentile(m, 50),
+                        mbpercentile(m, 90), mbpercentile(m, 99));
+            }
+        }
+        if (fclose(f) != 0) {
+            printf("Error writing %s: %s\n", savefile, strerror(errno));
+            exit(-1);
+        }
+        printf("Saved the results in %s\n", savefile);
     }
+    printf("Microbenchmarks of %s took %.3f seconds%s\n", filename,
+           now() - start, slower ? ", some are SLOWER than the baseline" : "");
+    return slower;
+}
+
+double started; // for --iostats
+
+void iostats() {
+    printf("I/O statistics for %s: %lu I/Os, %llu bytes, %.3f seconds\n",
+           disk.name, disk.completed, disk.bytes, now() - started);
 }
 
 int main(int argc, char* argv[]) {
@@ -253,38 +5463,190 @@ int main(int argc, char* argv[]) {
         printf("You must be root to run this\n");
         exit(EPERM);
     }
-    if (argc != 2) {
-        printf("I expect one argument, which must be the absolute filename of a raw block device\n");
-        exit(-1);
-    }
-    filename = argv[1];
-    if (strncmp(filename, "/dev/", 5) != 0) {
-        printf("%s does not look like a raw block device\n", filename);
-        exit(-1);
-    }
-    int fd = open(filename, O_LARGEFILE|O_SYNC|O_RDWR);
-    if (fd < 0) {
-        switch (errno) {
-            case ENODEV:
-            case ENXIO:
-            case ENOMEDIUM:
-                printf("No device connected at %s\n", filename);
+    const struct wipemethod * wipewith = NULL;
+    int doinventory = 0;
+    int scanmode = 0;
+    double budget = 0;
+    int sample = 0;
+    double confidence = SAMPLECONFIDENCE;
+    double maxbad = SAMPLEMAXBAD;
+    int verdict = 0;
+    char * rescanfile = NULL;
+    int doscreen = 0;
+    int digestmode = 0;
+    char * digestfile = NULL;
+    off_t guard = RESCANGUARD;
+    int domicrobench = 0;
+    int calibration = CALIBRATECACHED;
+    int retest = 0;
+    char * recordfile = NULL;
+    char * replayfile = NULL;
+    int fast = 0;
+    char * savefile = NULL;
+    char * baselinefile = NULL;
+    int json = 0;
+    char * names[argc];
+    int nnames = 0;
+    for (int a = 1; a < argc; ++a) {
+        if (strcmp(argv[a], "--wipe") == 0) {
+            wipewith = NULL;
+            if (++a < argc) {
+                for (int m = 0; m < NWIPEMETHODS; ++m) {
+                    if (strcmp(argv[a], wipemethods[m].name) == 0) {
+                        wipewith = wipemethods + m;
+                    }
+                }
+            }
+            if (wipewith == NULL) {
+                printf("--wipe needs discard, zeroout or secdiscard\n");
                 exit(-1);
-            case ENOENT:
-                printf("%s does not exist\n", filename);
+            }
+        } else if (strcmp(argv[a], "--timeout") == 0) {
+            if ((++a >= argc) || ((iotimeout = atof(argv[a])) <= 0)) {
+                printf("--timeout needs a positive number of seconds\n");
                 exit(-1);
-            case EPERM:
-            case EACCES:
-                printf("You aren't allowed to open %s\n", filename);
+            }
+        } else if (strcmp(argv[a], "--inventory") == 0) {
+            doinventory = 1;
+        } else if (strcmp(argv[a], "--json") == 0) {
+            json = 1;
+        } else if (strcmp(argv[a], "--budget") == 0) {
+            if ((++a >= argc) || ((budget = parseduration(argv[a])) < 0)) {
+                printf("--budget needs a time such as 30s, 5m or 1h\n");
                 exit(-1);
-            default:
-                printf("Error opening %s: %s\n", filename, strerror(errno));
+            }
+        } else if (strcmp(argv[a], "--sample") == 0) {
+            if ((++a >= argc) || ((sample = atoi(argv[a])) <= 0)) {
+                printf("--sample needs the most probes to do\n");
+                exit(-1);
+            }
+        } else if (strcmp(argv[a], "--confidence") == 0) {
+            if ((++a >= argc) || ((confidence = atof(argv[a])) <= 0)
+                || (confidence >= 1)) {
+                printf("--confidence needs a level between 0 and 1, such as 0.95\n");
+                exit(-1);
+            }
+        } else if (strcmp(argv[a], "--maxbad") == 0) {
+            if ((++a >= argc) || ((maxbad = atof(argv[a])) <= 0)
+                || (maxbad >= 1)) {
+                printf("--maxbad needs a fraction between 0 and 1, such as 0.001\n");
+                exit(-1);
+            }
+        } else if (strcmp(argv[a], "--iostats") == 0) {
+            started = now();
+            atexit(iostats); // before anything else, so it comes out last
+        } else if (strcmp(argv[a], "--screen") == 0) {
+            doscreen = 1;
+        } else if (strcmp(argv[a], "--calibrate") == 0) {
+            calibration = CALIBRATEFORCE;
+        } else if (strcmp(argv[a], "--nocalibrate") == 0) {
+            calibration = CALIBRATEOFF;
+        } else if ((strcmp(argv[a], "--record") == 0) && (a + 1 < argc)) {
+            recordfile = argv[++a];
+        } else if ((strcmp(argv[a], "--replay") == 0) && (a + 1 < argc)) {
+            replayfile = argv[++a];
+        } else if (strcmp(argv[a], "--fast") == 0) {
+            fast = 1;
+        } else if (strcmp(argv[a], "--retest") == 0) {
+            retest = 1;
+        } else if ((strcmp(argv[a], "--cache") == 0) && (a + 1 < argc)) {
+            cachefile = argv[++a];
+        } else if (strcmp(argv[a], "--microbench") == 0) {
+            domicrobench = 1;
+        } else if ((strcmp(argv[a], "--save") == 0) && (a + 1 < argc)) {
+            savefile = argv[++a];
+        } else if ((strcmp(argv[a], "--baseline") == 0) && (a + 1 < argc)) {
+            baselinefile = argv[++a];
+        } else if (strcmp(argv[a], "--scan") == 0) {
+            ++a;
+            if ((a < argc) && (strcmp(argv[a], "read") == 0)) {
+                scanmode = SCANREAD;
+            } else if ((a < argc) && (strcmp(argv[a], "write") == 0)) {
+                scanmode = SCANWRITE;
+            } else {
+                printf("--scan needs read or write\n");
                 exit(-1);
+            }
+        } else if (strcmp(argv[a], "--digest") == 0) {
+            if ((a + 2 < argc) && (strcmp(argv[a + 1], "save") == 0)) {
+                digestmode = DIGESTSAVE;
+            } else if ((a + 2 < argc) && (strcmp(argv[a + 1], "verify") == 0)) {
+                digestmode = DIGESTVERIFY;
+            } else {
+                printf("--digest needs save or verify and a file name\n");
+                exit(-1);
+            }
+            digestfile = argv[a + 2];
+            a += 2;
+        } else if ((strcmp(argv[a], "--rescan") == 0) && (a + 1 < argc)) {
+            rescanfile = argv[++a];
+        } else if (strcmp(argv[a], "--guard") == 0) {
+            if ((++a >= argc) || ((guard = atoll(argv[a])) < 0)) {
+                printf("--guard needs a number of bytes\n");
+                exit(-1);
+            }
+        } else if ((strcmp(argv[a], "--badblocks") == 0) && (a + 1 < argc)) {
+            badblocksfile = argv[++a];
+        } else if ((strcmp(argv[a], "--badmap") == 0) && (a + 1 < argc)) {
+            badmapfile = argv[++a];
+        } else {
+            names[nnames++] = argv[a];
+        }
+    }
+    struct aioinit ai;
+    memset(&ai, 0, sizeof(ai));
+    ai.aio_threads = 64;
+    ai.aio_num = 1024;
+    ai.aio_idle_time = 1;
+    aio_init(&ai);
+    if (doinventory) {
+        if (json) {
+            // keep stdout for the document, diagnostics go to stderr
+            int out = dup(1);
+            dup2(2, 1);
+            stdout = fdopen(out, "w");
         }
+        inventory(names, nnames, json);
+        exit(0);
+    }
+    if (nnames == 1) {
+        filename = names[0];
+    } else {
+        printf("I expect one argument, which must be the absolute filename of a raw block device,\n");
+        printf("an image file, or sim:<settings> for the fake device simulator\n");
+        printf("optionally preceded by --timeout <seconds to wait for an I/O before giving up>\n");
+        printf("and --calibrate or --nocalibrate to redo or skip choosing how to drive the device\n");
+        printf("and --cache <file> to keep what we learn about devices somewhere else\n");
+        printf("and --retest to test a device again even if nothing has changed since its last test\n");
+        printf("and --wipe discard|zeroout|secdiscard to blank the device after the test\n");
+        printf("and --budget <time> to spread as many probes as fit in that time over the device\n");
+        printf("or --sample <probes> [--confidence <level>] [--maxbad <fraction>] to sample random blocks\n");
+        printf("or --screen to look for signs of a fake without writing anything\n");
+        printf("or --scan read|write to scan the whole surface instead of the size test\n");
+        printf("and --badblocks <file> or --badmap <file> to save the bad regions found\n");
+        printf("or --rescan <badmap> [--guard <bytes>] to scan only the regions an earlier run found\n");
+        printf("or --digest save|verify <file> to save or check a digest of the contents\n");
+        printf("or --microbench [--save <file>] [--baseline <file>] to time the I/O primitives and kernels\n");
+        printf("and --record <file> to keep a trace of every I/O\n");
+        printf("or --replay <file> [--fast] to issue the I/Os in a trace again\n");
+        printf("or --inventory [--json] [devices...] to list devices without writing anything\n");
+        exit(-1);
+    }
+    struct stat st;
+    if ((strncmp(filename, "/dev/", 5) != 0) && (strncmp(filename, "sim:", 4) != 0)
+        && ((stat(filename, &st) != 0) || !S_ISREG(st.st_mode))) {
+        printf("%s does not look like a raw block device or an image file\n",
+               filename);
+        exit(-1);
+    }
+    if (devopen(&disk, filename, O_RDWR) < 0) {
+        openerror(filename);
+        exit(-1);
     }
+    int fd = disk.fd;
     // We've got a device, now try and get its size
     unsigned long long totalsize;
-    int res = ioctl(fd, BLKGETSIZE64, &totalsize);
+    int res = devsize(&disk, &totalsize);
     if (res < 0) {
         switch (errno) {
             case ENOTBLK:
@@ -303,7 +5665,15 @@ int main(int argc, char* argv[]) {
     }
     printf("%s reports its total size as %llu bytes%s\n",
            filename, totalsize, human(totalsize));
-    res = ioctl(fd, BLKSSZGET, &blocksize);
+    if (disk.backend == BACKENDSIM) {
+        blocksize = disk.sim->block;
+        res = 0;
+    } else if (disk.backend == BACKENDFILE) {
+        blocksize = MINBLOCKSIZE;
+        res = 0;
+    } else {
+        res = ioctl(fd, BLKSSZGET, &blocksize);
+    }
     if (res < 0) {
         switch (errno) {
             case ENOTBLK:
@@ -322,23 +5692,40 @@ int main(int argc, char* argv[]) {
     }
     printf("%s reports its sector size as %llu bytes%s\n", filename,
            blocksize, human(blocksize));
-    unsigned char buffer[MAXBLOCKSIZE];
-    if (close(fd) != 0) {
-        printf("Error closing %s: %s\n", filename, strerror(errno));
-        exit(-1);
+    if (recordfile != NULL) {
+        traceopen(recordfile, totalsize);
     }
+    probetopology(&disk);
+    tuneio(&disk);
+    opendirect(&disk);
+    printtopology(&disk);
+    setreadahead(&disk, READAHEADRANDOM);
+    unsigned char buffer[MAXBLOCKSIZE] ALIGNED;
     // Read the Master Boot Record:
-    checkedread(0, buffer, MINBLOCKSIZE);
+    if (checkedread(0, buffer, MINBLOCKSIZE) != 0) {
+        exit(-1);
+    }
+    layouthash = crc32(0, buffer, MINBLOCKSIZE);
     /* Partition type is stored at block 0 address 450 (decimal)
      * A type of 0xEE indicates GPT partitioning.
      */
     if (buffer[450] == 0xEE) {
-        size_t size;
+        size_t size = blocksize;
         printf("%s appears to have GPT partitioning\n", filename);
-        for (size = MINBLOCKSIZE; size <= MAXBLOCKSIZE; size *= 2) {
-            checkedread(size, buffer, size);
-            if (*(unsigned long long *)buffer == 0x5452415020494645ULL) {
-                break; // found a GPT header
+        /* The GPT header is in the second logical block, but the disk may
+         * have been partitioned in an enclosure with a different sector size.
+         */
+        if (checkedread(size, buffer, size) != 0) {
+            exit(-1);
+        }
+        if (*(unsigned long long *)buffer != 0x5452415020494645ULL) {
+            for (size = MINBLOCKSIZE; size <= MAXBLOCKSIZE; size *= 2) {
+                if (checkedread(size, buffer, size) != 0) {
+                    exit(-1);
+                }
+                if (*(unsigned long long *)buffer == 0x5452415020494645ULL) {
+                    break; // found a GPT header
+                }
             }
         }
         blocksize = size;
@@ -346,73 +5733,151 @@ int main(int argc, char* argv[]) {
             printf("Could not find GPT header on %s\n", filename);
         } else {
             printf("GPT header sector size is %lu\n", blocksize);
+            layouthash = crc32(layouthash, buffer, size);
             printf("GPT main header on %s is at address %llu\n",
                    filename, blocksize);
-            printf("GPT main header reports its own address as %llu\n",
-                   *(off_t *)(buffer + 24) * blocksize);
-            printf("GPT main header reports first usable block as %llu\n",
-                   *(off_t *)(buffer + 40) * blocksize);
-            printf("GPT main header reports last usable block as %llu\n",
-                   *(off_t *)(buffer + 48) * blocksize);
-            off_t backup = *(off_t *)(buffer + 32) * blocksize;
-            off_t ptable = *(off_t *)(buffer + 72) * blocksize;
-            int pcount = *(u_int32_t *)(buffer + 80);
-            int psize = *(u_int32_t *)(buffer + 84);
-            checkedread(ptable, buffer, blocksize);
+            struct gpt primary;
+            struct gpt backup;
+            gptparse(buffer, size, size, &primary);
+            gptfetch(&primary, &backup, totalsize);
+            printf("GPT main header reports its own address as %ld\n",
+                   primary.myaddress);
+            printf("GPT main header reports first usable block as %ld\n",
+                   primary.firstusable);
+            printf("GPT main header reports last usable block as %ld\n",
+                   primary.lastusable);
+            printf("GPT main header CRC 0x%08X is %s\n", primary.headercrc,
+                   primary.headercrcok ? "correct" : "WRONG");
             printf("GPT main partition table:\n");
-            partitions(ptable, pcount, psize);
-            printf("GPT main header reports backup header address as %llu\n",
-                   backup);
-            checkedread(backup, buffer, blocksize);
-            if (*(unsigned long long *)buffer != 0x5452415020494645ULL) {
-                printf("GPT backup header invalid signature 0x%lX\n",
-                       *(unsigned long long *)buffer);
-            } else {
-                printf("GPT backup header reports its own address as %lu\n",
-                    *(off_t *)(buffer + 24) * blocksize);
-                backup = *(off_t *)(buffer + 32) * size;
-                printf("GPT backup header reports main header address as %lu\n",
-                    backup);
-                printf("GPT backup header reports first usable block as %llu\n",
-                    *(off_t *)(buffer + 40) * blocksize);
-                printf("GPT backup header reports last usable block as %llu\n",
-                    *(off_t *)(buffer + 48) * blocksize);
-                off_t ptable = *(off_t *)(buffer + 72) * blocksize;
-                u_int32_t pcount = *(u_int32_t *)(buffer + 80);
-                u_int32_t psize = *(u_int32_t *)(buffer + 84);
-                checkedread(ptable, buffer, blocksize);
+            partitions(&primary);
+            printf("GPT main header reports backup header address as %ld\n",
+                   primary.alternate);
+            if (backup.lbsize != 0) {
+                printf("GPT backup header reports its own address as %ld\n",
+                    backup.myaddress);
+                printf("GPT backup header reports main header address as %ld\n",
+                    backup.alternate);
+                printf("GPT backup header reports first usable block as %ld\n",
+                    backup.firstusable);
+                printf("GPT backup header reports last usable block as %ld\n",
+                    backup.lastusable);
+                printf("GPT backup header CRC 0x%08X is %s\n",
+                       backup.headercrc,
+                       backup.headercrcok ? "correct" : "WRONG");
                 printf("GPT backup partition table:\n");
-                partitions(ptable, pcount, psize);
+                partitions(&backup);
+            }
+            gptdiff(&primary, &backup, totalsize);
+            gptlayout(&primary, totalsize);
+            if (!layoutknown) {
+                gptlayout(&backup, totalsize);
             }
         }
+    } else if ((*(uint16_t *)(buffer + 510) == MBRSIGNATURE)
+               && mbrvalid(buffer, totalsize)) {
+        printf("%s appears to have MBR partitioning\n", filename);
+        mbrpartitions(buffer, totalsize);
     }
-    FILE * pm = fopen("/proc/mounts", "r");
-    if (pm == NULL) {
-        printf("cannot open /proc/mounts: %s\n", strerror(errno));
-        exit(-1);
+    blocksize = disk.topo.logical; // the GPT may have been written for another size
+    if (disk.backend == BACKENDDEVICE) {
+        findbusy(totalsize);
+    }
+    if (layoutknown) {
+        filesystems();
+    }
+    /* Nothing is written until a test which writes has been accepted, so
+     * we calibrate with reads now, and with writes as well after that.
+     */
+    cacheload(&disk);
+    calibrate(&disk, totalsize, calibration, 0);
+    if (replayfile != NULL) {
+        exit(replay(replayfile, fast, totalsize) ? 1 : 0);
+    }
+    if (domicrobench) {
+        exit(microbench(totalsize, savefile, baselinefile));
+    }
+    if (doscreen) {
+        exit(screen(totalsize, 1));
+    }
+    if (digestmode != 0) {
+        digest(digestmode, digestfile, totalsize);
+        exit(disk.failed ? -1 : 0);
     }
-    size_t len = strlen(filename);
-    while (fgets(buffer, MAXBLOCKSIZE, pm) != NULL) {
-        if (strncmp(filename, buffer, len) == 0) {
-            printf("Read/write size test cannot safely be done because\n");
-            printf("%s has a mounted partition\n", filename);
-            exit(0);
+    if ((rescanfile != NULL) && (scanmode == 0)) {
+        scanmode = SCANREAD;
+    }
+    if (scanmode != 0) {
+        struct extent * ranges = NULL;
+        int nranges = 0;
+        struct extent * old[NBADKINDS] = { NULL };
+        int nold[NBADKINDS] = { 0 };
+        if (rescanfile != NULL) {
+            loadbadmap(rescanfile, totalsize, old, nold);
+            for (int k = 0; k < NBADKINDS; ++k) {
+                for (int i = 0; i < nold[k]; ++i) {
+                    off_t lo = (old[k][i].start > guard)
+                               ? (old[k][i].start - guard) / blocksize * blocksize
+                               : 0;
+                    off_t hi = (old[k][i].end + guard + blocksize - 1)
+                               / blocksize * blocksize;
+                    addextent(&ranges, &nranges, lo,
+                              (hi < totalsize) ? hi : totalsize);
+                }
+            }
+        } else {
+            addextent(&ranges, &nranges, 0, totalsize);
+        }
+        if ((wipewith != NULL) && (scanmode != SCANWRITE)) {
+            printf("--wipe needs the size test or a write scan first\n");
+            exit(-1);
+        } else if ((scanmode == SCANWRITE) && (nbusy > 0)) {
+            printf("%s has partitions in use, so it can't have a write scan\n",
+                   filename);
+            exit(-1);
+        } else if (scanmode == SCANWRITE) {
+            printf("The write scan overwrites every block it scans. It will destroy %s on %s\n",
+                   (rescanfile != NULL) ? "the data around the bad regions"
+                                        : "ALL the data", filename);
+            printf("Do you want to do a write scan (Y/N)?");
+            if (confirm() == 0) { exit(0); }
+            printf("Are you sure?");
+            if (confirm() == 0) { exit(0); }
+            claimdevice("the write scan");
+            calibrate(&disk, totalsize, (calibration == CALIBRATEOFF)
+                                        ? CALIBRATEOFF : CALIBRATECACHED, 1);
         }
-        // just in case /proc/mounts has some very long lines
-        while (buffer[strlen(buffer) - 1] != '\n')
-        {
-            if (fgets(buffer, MAXBLOCKSIZE, pm) == NULL) {
-                goto errorcheck;
+        badsize = totalsize;
+        atexit(badreport);
+        surfacescan(scanmode, ranges, nranges, totalsize);
+        if (rescanfile != NULL) {
+            rescanreport(old, nold, guard, scanmode, totalsize);
+        }
+        if ((wipewith != NULL) && !disk.failed) {
+            int failures = 0;
+            for (int k = 0; k < BADSLOW; ++k) {
+                failures += nbad[k];
+            }
+            if (failures > 0) {
+                printf("The write scan found bad regions, so %s will not be wiped\n",
+                       filename);
+                exit(-1);
             }
+            offerwipe(wipewith, "write scan", totalsize);
         }
+        exit(disk.failed ? -1 : 0);
+    }
+
+    if (devicebusy != NULL) {
+        printf("Read/write size test cannot safely be done because\n");
+        printf("%s is %s\n", filename, devicebusy);
+        exit(0);
     }
-    errorcheck:
-    // NULL return can be EOF or error
-    if (!feof(pm)) {
-        printf("Error reading /proc/mounts: %s\n", strerror(errno));
+    if ((wipewith != NULL) && (nbusy > 0)) {
+        printf("%s has partitions in use, so it can't be wiped\n", filename);
         exit(-1);
     }
-
+    screened = screen(totalsize, 0);
+    cachetest = (sample > 0) ? "sample" : (budget > 0) ? "budget" : "size";
     printf("The read/write size test will check the real amount of storage\n");
     printf("on the device. It tries not to corrupt the data on the device\n");
     printf("but this cannot be guaranteed. It should only be run when\n");
@@ -421,6 +5886,11 @@ int main(int argc, char* argv[]) {
     if (confirm() == 0) { exit(0); }
     printf("Are you sure?");
     if (confirm() == 0) { exit(0); }
+    if (nbusy == 0) {
+        claimdevice("the size test"); // else we claim partitions as we go
+    }
+    calibrate(&disk, totalsize, (calibration == CALIBRATEOFF)
+                                ? CALIBRATEOFF : CALIBRATECACHED, 1);
 
     /* We walk up the device testing addresses which are one sector
      * less than powers of 2, looking for these possible errors:
@@ -433,10 +5903,13 @@ int main(int argc, char* argv[]) {
      * power of two less than the address to which we tried to write:
      * this corresponds to the device ignoring the highest bit of the address.
      */
+    off_t addresses[MAXPROBES];
+    off_t modulos[MAXPROBES];
+    int n = 0;
     off_t offset = 1024*1024; // Start at 1 Mibyte
-    int i;
-    for (i = 0; offset <= totalsize; ++i) {
-        readbacktest(offset, offset / 2, i);
+    for ( ; offset <= totalsize; ++n) {
+        addresses[n] = offset;
+        modulos[n] = offset / 2;
         offset = offset * 2;
     }
     if (offset != totalsize) {
@@ -445,10 +5918,62 @@ int main(int argc, char* argv[]) {
         offset = offset / 2;
         off_t modulo = offset;
         while (totalsize - offset > 1024*1024) {
-            ++i;
             offset = (offset + totalsize) / 2;
-            readbacktest(offset, modulo, i);
+            addresses[n] = offset;
+            modulos[n++] = modulo;
+        }
+    }
+    if (!retest && (wipewith == NULL)) {
+        cachedresult(cachetest, addresses, modulos, n, totalsize);
+    }
+    badsize = totalsize;
+    atexit(badreport);
+    testedsize = totalsize;
+    cacheverdict = "failed"; // until it passes
+    atexit(cacheremember);
+    int batch = disk.topo.rotational ? PROBEBATCH : 1;
+    if (sample > 0) {
+        n = sampletest(sample, confidence, maxbad, batch, totalsize, &verdict);
+    } else if (budget > 0) {
+        n = budgettest(budget, batch, totalsize);
+    } else {
+        int moved = placeprobes(addresses, modulos, &n, totalsize);
+        if (moved > 0) {
+            printf("Moved %d of %d probes into free space or idle partitions\n",
+                   moved, n);
         }
+        claimpartitions(addresses, n);
+        for (int i = 0; i < n; i += batch) {
+            int nb = (n - i < batch) ? n - i : batch;
+            int failed[PROBEBATCH] = { 0 };
+            int res = readbacktest(addresses, modulos, i, nb, totalsize, failed);
+            for (int k = 0; k < nb; ++k) {
+                if (!failed[k] && (addresses[i + k] > proven)) {
+                    proven = addresses[i + k];
+                }
+            }
+            if (res) {
+                exit(-1);
+            }
+        }
+    }
+    if (disk.topo.rotational) {
+        printf("Probes on %s needed %lu seeks instead of %lu, saving about %.2f seconds of seeking\n",
+               filename, scheduled.seeks, unscheduled.seeks,
+               unscheduled.seconds - scheduled.seconds);
+    }
+    if (freeprobes > 0) {
+        printf("%lu of %d probes were in free space and needed no save and restore, saving %lu I/Os\n",
+               freeprobes, n, 2 * freeprobes);
+    }
+    proven = totalsize;
+    cacheverdict = (verdict < 0) ? "rejected"
+                   : ((sample > 0) && (verdict == 0)) ? "undecided" : "passed";
+    if (verdict < 0) {
+        exit(1); // rejected by sampling
+    }
+    if (wipewith != NULL) {
+        offerwipe(wipewith, "size test", totalsize);
     }
     exit(0);
 }
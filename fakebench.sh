@@ -0,0 +1,176 @@
+#!/bin/bash
+# Benchmark disksize against reproducible bad devices, writing JSON.
+#
+# Each case is built from a sparse file on a loop device with device-mapper
+# targets on top (dm-linear, dm-delay, dm-flakey, dm-error). Where
+# device-mapper isn't available, or with --sim, the same faults come from
+# disksize's own fake device simulator instead. Every mode is run against
+# every case and we record whether it found what it should have, how many
+# I/Os it did and how long it took, so that a change which makes detection
+# slower or worse shows up before it reaches anyone's intake line.
+#
+# Usage: fakebench.sh [--sim] [--disksize path] [--dir scratch-dir] > results.json
+# Must be run as root. The scratch directory holds the sparse files.
+
+DISKSIZE=./disksize
+DIR=/var/tmp/fakebench
+USESIM=0
+while [ $# -gt 0 ]; do
+    case "$1" in
+        --sim) USESIM=1 ;;
+        --disksize) DISKSIZE="$2"; shift ;;
+        --dir) DIR="$2"; shift ;;
+        *) echo "Usage: $0 [--sim] [--disksize path] [--dir scratch-dir]" >&2; exit 2 ;;
+    esac
+    shift
+done
+if [ ! -x "$DISKSIZE" ]; then
+    echo "$DISKSIZE not found: build it with cc -O2 -o disksize disksize.c -lrt -lm" >&2
+    exit 2
+fi
+if [ $USESIM = 0 ] && ! dmsetup version >/dev/null 2>&1; then
+    echo "device-mapper is not available, using the simulator" >&2
+    USESIM=1
+fi
+
+G=$((1024 * 1024 * 1024))
+SECTORS=$((G / 512)) # sectors per Gibyte, for dm tables
+
+# name, what a test should find (fake, bad, slow or good), simulator
+# settings, and the function which builds the dm table
+CASES=(
+    "alias64 fake size=64G,real=32G,fake=wrap table_alias64"
+    "slow32 slow size=32G,slow=8388608K-8454144K@2000 table_slow32"
+    "stripes16 bad size=16G,eio=2097152K-2098176K,eio=6291456K-6292480K,eio=10485760K-10486784K,eio=14680064K-14681088K table_stripes16"
+    "drop32 fake size=32G,real=16G,fake=drop table_drop32"
+    "good8 good size=8G table_good8"
+)
+MODES=(
+    "size"
+    "budget --budget 10s"
+    "sample --sample 2000"
+    "screen --screen"
+    "scan --scan read"
+)
+
+# The tables are built in subshells, so we find the loop devices again by
+# their backing files when we clean up
+DMS=()
+cleanup() {
+    for d in "${DMS[@]}"; do dmsetup remove "$d" 2>/dev/null; done
+    for f in "$DIR"/*.img; do
+        [ -e "$f" ] || continue
+        losetup -j "$f" | cut -d: -f1 | while read -r l; do losetup -d "$l"; done
+        rm -f "$f"
+    done
+}
+trap cleanup EXIT
+
+# A loop device on a sparse file of $1 Gibytes
+backing() {
+    mkdir -p "$DIR"
+    truncate -s "$1"G "$DIR/$2.img"
+    losetup --find --show "$DIR/$2.img" || exit 1
+}
+
+# 64 Gibytes whose upper half maps back onto the lower half
+table_alias64() {
+    local l
+    l=$(backing 32 alias64)
+    echo "0 $((32 * SECTORS)) linear $l 0"
+    echo "$((32 * SECTORS)) $((32 * SECTORS)) linear $l 0"
+}
+
+# 32 Gibytes with a 64 Mibyte band at 8 Gibytes which takes 2 seconds per
+# I/O, slow enough for disksize to call it slow
+table_slow32() {
+    local l band=131072
+    l=$(backing 32 slow32)
+    echo "0 $((8 * SECTORS)) linear $l 0"
+    echo "$((8 * SECTORS)) $band delay $l $((8 * SECTORS)) 2000"
+    echo "$((8 * SECTORS + band)) $((24 * SECTORS - band)) linear $l $((8 * SECTORS + band))"
+}
+
+# 16 Gibytes with a 1 Mibyte stripe of errors every 4 Gibytes from 2
+table_stripes16() {
+    local l s=0 mib=2048
+    l=$(backing 16 stripes16)
+    for g in 2 6 10 14; do
+        echo "$s $((g * SECTORS - s)) linear $l $s"
+        echo "$((g * SECTORS)) $mib error"
+        s=$((g * SECTORS + mib))
+    done
+    echo "$s $((16 * SECTORS - s)) linear $l $s"
+}
+
+# 32 Gibytes of which writes to the upper 16 are silently dropped
+table_drop32() {
+    local l
+    l=$(backing 32 drop32)
+    echo "0 $((16 * SECTORS)) linear $l 0"
+    echo "$((16 * SECTORS)) $((16 * SECTORS)) flakey $l $((16 * SECTORS)) 0 3600 1 drop_writes"
+}
+
+table_good8() {
+    local l
+    l=$(backing 8 good8)
+    echo "0 $((8 * SECTORS)) linear $l 0"
+}
+
+# What a run found, from its output and exit status
+verdict() {
+    if grep -q -e "aliasing in" -e "wrong data in" -e "looks like a FAKE" \
+            -e "corrupted address" -e "read back" "$1"; then
+        echo fake
+    elif grep -q -e "read errors in" -e "write errors in" -e "failed:" "$1"; then
+        echo bad
+    elif grep -q -e "slow I/O in" -e "looks suspicious" "$1"; then
+        echo slow
+    elif [ "$2" != 0 ]; then
+        echo bad
+    else
+        echo good
+    fi
+}
+
+echo "["
+first=1
+for c in "${CASES[@]}"; do
+    read -r name expect sim table <<< "$c"
+    if [ $USESIM = 1 ]; then
+        dev="sim:$sim"
+        backend=sim
+    else
+        dmsetup create "fakebench-$name" < <($table) || exit 1
+        DMS+=("fakebench-$name")
+        dev="/dev/mapper/fakebench-$name"
+        backend=dm
+    fi
+    for m in "${MODES[@]}"; do
+        read -r mode args <<< "$m"
+        out=$(mktemp)
+        start=$(date +%s.%N)
+        # answer yes to the questions, which need a terminal
+        printf 'Y\nY\n' | script -qec "$DISKSIZE --iostats $args $dev" /dev/null > "$out" 2>&1
+        status=$?
+        end=$(date +%s.%N)
+        found=$(verdict "$out" $status)
+        stats=$(grep -o "I/O statistics.*" "$out" | tail -1)
+        ios=$(echo "$stats" | sed -n 's/.*: \([0-9]*\) I\/Os.*/\1/p')
+        bytes=$(echo "$stats" | sed -n 's/.* \([0-9]*\) bytes.*/\1/p')
+        seconds=$(echo "$stats" | sed -n 's/.* \([0-9.]*\) seconds.*/\1/p')
+        [ $first = 1 ] || echo ","
+        first=0
+        printf '  {"case": "%s", "backend": "%s", "mode": "%s", "expected": "%s", "found": "%s", "correct": %s, "ios": %s, "bytes": %s, "seconds": %s, "wallseconds": %.3f, "status": %d}' \
+            "$name" "$backend" "$mode" "$expect" "$found" \
+            "$([ "$found" = "$expect" ] && echo true || echo false)" \
+            "${ios:-0}" "${bytes:-0}" "${seconds:-0}" \
+            "$(awk "BEGIN { print $end - $start }")" $status
+        rm -f "$out"
+    done
+    if [ $USESIM = 0 ]; then
+        dmsetup remove "fakebench-$name"
+    fi
+done
+echo
+echo "]"